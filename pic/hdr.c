@@ -0,0 +1,302 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "pic.h"
+
+
+
+/*
+ * hdr: subroutines for reading and writing Radiance RGBE (.hdr) picture
+ *	files.  Each pixel is 8-bit red, green and blue sharing an 8-bit
+ *	exponent.  Scanlines are written with the adaptive run length
+ *	encoding; flat and old style run length files can also be read.
+ */
+
+#define HDR_MIN_RLE 8		/* scanlines narrower than this are flat */
+#define HDR_MAX_RLE 0x7fff	/* and wider ones too */
+#define HDR_MAX_RUN 127
+#define HDR_MAX_VALUE 1.7e38	/* just under 2^127, the largest exponent */
+
+/* hdr_clamp: a channel RGBE can hold, NaN as black and anything past
+ *	the largest exponent, infinity included, as the largest value */
+static float hdr_clamp(float c) {
+    if (c != c) return 0;
+    if (c > HDR_MAX_VALUE) return HDR_MAX_VALUE;
+    return c;
+}
+
+/* hdr_float_to_rgbe: pack one color into shared exponent form */
+static void hdr_float_to_rgbe(unsigned char rgbe[4], float r, float g, float b) {
+    double v, m;
+    int e;
+
+    r = hdr_clamp(r);
+    g = hdr_clamp(g);
+    b = hdr_clamp(b);
+    v = r;
+    if (g > v) v = g;
+    if (b > v) v = b;
+    if (v < 1e-32) {
+	rgbe[0] = rgbe[1] = rgbe[2] = rgbe[3] = 0;
+	return;
+    }
+    m = frexp(v, &e) * 256.0 / v;
+    rgbe[0] = (unsigned char)(r > 0 ? r * m : 0);
+    rgbe[1] = (unsigned char)(g > 0 ? g * m : 0);
+    rgbe[2] = (unsigned char)(b > 0 ? b * m : 0);
+    rgbe[3] = (unsigned char)(e + 128);
+}
+
+/* hdr_rgbe_to_float: unpack a shared exponent color */
+static void hdr_rgbe_to_float(unsigned char rgbe[4], PixelF *c) {
+    double f;
+
+    if (rgbe[3] == 0) {
+	c[0] = c[1] = c[2] = 0;
+	return;
+    }
+    f = ldexp(1.0, (int)rgbe[3] - (128+8));
+    c[0] = (rgbe[0] + 0.5) * f;
+    c[1] = (rgbe[1] + 0.5) * f;
+    c[2] = (rgbe[2] + 0.5) * f;
+}
+
+/* hdr_read_header: skip the text header and read the resolution line */
+static int hdr_read_header(FILE *fp, char *file, int *nx, int *ny) {
+    char line[256];
+    int format_ok = 1;
+
+    if (!fgets(line, sizeof line, fp) || line[0] != '#' || line[1] != '?') {
+	fprintf(stderr, "%s is not a valid HDR file, bad magic#\n", file);
+	return 0;
+    }
+    /* variables until a blank line */
+    for (;;) {
+	if (!fgets(line, sizeof line, fp)) {
+	    fprintf(stderr, "%s is not a valid HDR file: no resolution\n", file);
+	    return 0;
+	}
+	if (line[0] == '\n' || (line[0] == '\r' && line[1] == '\n'))
+	    break;
+	if (!strncmp(line, "FORMAT=", 7) &&
+	    strncmp(line+7, "32-bit_rle_rgbe", 15))
+	    format_ok = 0;
+    }
+    if (!format_ok) {
+	fprintf(stderr, "%s: only 32-bit_rle_rgbe HDR files are supported\n",
+	    file);
+	return 0;
+    }
+    /* only the standard top-down orientation */
+    if (!fgets(line, sizeof line, fp) ||
+	sscanf(line, "-Y %d +X %d", ny, nx) != 2 || *nx <= 0 || *ny <= 0) {
+	fprintf(stderr, "%s: unsupported HDR resolution line\n", file);
+	return 0;
+    }
+    return 1;
+}
+
+/* hdr_read_flat: read plain or old style run length pixels start..nx-1 */
+static int hdr_read_flat(FILE *fp, unsigned char *scan, int start, int nx) {
+    int i = start, shift = 0, n;
+
+    while (i < nx) {
+	if (fread(&scan[4*i], 4, 1, fp) != 1)
+	    return 0;
+	/* 1,1,1,n repeats the previous pixel n << shift times */
+	if (scan[4*i] == 1 && scan[4*i+1] == 1 && scan[4*i+2] == 1) {
+	    if (i == 0)
+		return 0;
+	    for (n = scan[4*i+3] << shift; n > 0 && i < nx; n--, i++)
+		memcpy(&scan[4*i], &scan[4*(i-1)], 4);
+	    shift += 8;
+	}
+	else {
+	    i++;
+	    shift = 0;
+	}
+    }
+    return 1;
+}
+
+/* hdr_read_scanline: read one scanline of RGBE bytes into scan[nx][4] */
+static int hdr_read_scanline(FILE *fp, unsigned char *scan, int nx) {
+    unsigned char head[4], val;
+    int chan, i, n, c;
+
+    if (nx < HDR_MIN_RLE || nx > HDR_MAX_RLE)
+	return hdr_read_flat(fp, scan, 0, nx);
+    if (fread(head, 4, 1, fp) != 1)
+	return 0;
+    if (head[0] != 2 || head[1] != 2 || (head[2] & 0x80)) {
+	/* not run length encoded, head is the first pixel */
+	memcpy(scan, head, 4);
+	return hdr_read_flat(fp, scan, 1, nx);
+    }
+    if (((head[2] << 8) | head[3]) != nx)
+	return 0;
+
+    /* each channel is encoded separately */
+    for (chan = 0; chan < 4; chan++) {
+	for (i = 0; i < nx; ) {
+	    if ((c = getc(fp)) == EOF)
+		return 0;
+	    if (c > 128) {
+		n = c - 128;
+		if (n > nx - i || (c = getc(fp)) == EOF)
+		    return 0;
+		val = (unsigned char)c;
+		while (n--)
+		    scan[4*(i++)+chan] = val;
+	    }
+	    else {
+		n = c;
+		if (n == 0 || n > nx - i)
+		    return 0;
+		while (n--) {
+		    if ((c = getc(fp)) == EOF)
+			return 0;
+		    scan[4*(i++)+chan] = (unsigned char)c;
+		}
+	    }
+	}
+    }
+    return 1;
+}
+
+/* hdr_write_channel: run length encode one channel of a scanline */
+static int hdr_write_channel(FILE *fp, unsigned char *scan, int chan, int nx) {
+    int i = 0, run, lit;
+
+    while (i < nx) {
+	/* find the next run of at least 3 equal bytes */
+	for (lit = i; lit < nx; lit++) {
+	    for (run = 1; lit+run < nx && run < HDR_MAX_RUN &&
+		scan[4*(lit+run)+chan] == scan[4*lit+chan]; run++);
+	    if (run >= 3)
+		break;
+	}
+	/* bytes before it go out as literals */
+	while (i < lit) {
+	    int n = lit - i;
+	    if (n > 128) n = 128;
+	    putc(n, fp);
+	    while (n--)
+		putc(scan[4*(i++)+chan], fp);
+	}
+	if (lit < nx) {
+	    putc(128 + run, fp);
+	    putc(scan[4*lit+chan], fp);
+	    i = lit + run;
+	}
+    }
+    return !ferror(fp);
+}
+
+/* hdr_get_size: get size in pixels of HDR picture file */
+int hdr_get_size(char *file, int *nx, int *ny) {
+    FILE *fp;
+    int ok;
+
+    if ((fp = fopen(file, "rb")) == NULL) {
+	fprintf(stderr, "can't read HDR file %s\n", file);
+	return 0;
+    }
+    ok = hdr_read_header(fp, file, nx, ny);
+    fclose(fp);
+    return ok;
+}
+
+/*
+ * hdr_read: read a Radiance HDR file into a 3 channel float picture.
+ * If opic!=0, then picture is read into opic->pix (after checking that
+ * size is sufficient), else a new FPic is allocated.
+ * Returns FPic pointer on success, 0 on failure.
+ */
+FPic *hdr_read(char *file, FPic *opic) {
+    FILE *fp;
+    int nx, ny, x, y;
+    unsigned char *scan;
+    FPic *p;
+
+    if ((fp = fopen(file, "rb")) == NULL) {
+	fprintf(stderr, "can't read HDR file %s\n", file);
+	return 0;
+    }
+    if (!hdr_read_header(fp, file, &nx, &ny)) {
+	fclose(fp);
+	return 0;
+    }
+
+    p = fpic_alloc(nx, ny, 3, opic);
+    ALLOC(scan, unsigned char, nx*4);
+    printf("reading HDR file %s: %dx%d pixels\n", file, p->nx, p->ny);
+
+    for (y = 0; y < ny; y++) {
+	if (!hdr_read_scanline(fp, scan, nx)) {
+	    fprintf(stderr, "bad or truncated scanline %d in file %s\n", y, file);
+	    if (p->pix != (opic ? opic->pix : 0)) free(p->pix);
+	    free(p);
+	    free(scan);
+	    fclose(fp);
+	    return 0;
+	}
+	for (x = 0; x < nx; x++)
+	    hdr_rgbe_to_float(&scan[4*x], &FPIC_PIXEL(p, x, y, 0));
+    }
+    free(scan);
+    fclose(fp);
+    return p;
+}
+
+int hdr_write(char *file, FPic *pic)
+{
+    FILE *hdr;
+    unsigned char *scan;
+    PixelF *c;
+    int x, y, ok = TRUE;
+
+    if (pic->nc != 1 && pic->nc != 3) {
+	fprintf(stderr, "hdr_write: can't write %d channel FPic\n", pic->nc);
+	return FALSE;
+    }
+
+    hdr = fopen(file, "wb");
+    if( !hdr )
+	return FALSE;
+
+    fprintf(hdr, "#?RADIANCE\nFORMAT=32-bit_rle_rgbe\n\n-Y %d +X %d\n",
+	pic->ny, pic->nx);
+
+    ALLOC(scan, unsigned char, pic->nx*4);
+    for (y = 0; y < pic->ny && ok; y++) {
+	for (x = 0; x < pic->nx; x++) {
+	    c = &FPIC_PIXEL(pic, x, y, 0);
+	    /* gray pictures repeat the one channel */
+	    if (pic->nc == 3)
+		hdr_float_to_rgbe(&scan[4*x], c[0], c[1], c[2]);
+	    else
+		hdr_float_to_rgbe(&scan[4*x], c[0], c[0], c[0]);
+	}
+	if (pic->nx < HDR_MIN_RLE || pic->nx > HDR_MAX_RLE)
+	    ok = fwrite(scan, 4, pic->nx, hdr) == pic->nx;
+	else {
+	    putc(2, hdr);
+	    putc(2, hdr);
+	    putc(pic->nx >> 8, hdr);
+	    putc(pic->nx & 0xff, hdr);
+	    ok = hdr_write_channel(hdr, scan, 0, pic->nx) &&
+		 hdr_write_channel(hdr, scan, 1, pic->nx) &&
+		 hdr_write_channel(hdr, scan, 2, pic->nx) &&
+		 hdr_write_channel(hdr, scan, 3, pic->nx);
+	}
+    }
+    free(scan);
+
+    if (!ok)
+	fprintf(stderr, "hdr_write: error writing %s\n", file);
+    fclose(hdr);
+    return ok;
+}
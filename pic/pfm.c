@@ -0,0 +1,145 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pic.h"
+
+
+
+/*
+ * pfm: subroutines for reading and writing Portable Float Map files,
+ *	the float counterpart of PPM.  "PF" is 3 channel, "Pf" is 1 channel.
+ *	The scale line is negative for little endian data, and rows are
+ *	stored bottom row first.
+ */
+
+/* ppm_get_token is shared with ppm.c */
+extern char *ppm_get_token(FILE *fp, char *tok, int len);
+
+/* pfm_little_endian: nonzero when this machine stores floats little endian */
+static int pfm_little_endian(void) {
+    unsigned int one = 1;
+    return *(unsigned char *)&one == 1;
+}
+
+/* pfm_swap: reverse the byte order of n floats */
+static void pfm_swap(PixelF *f, int n) {
+    unsigned char *b, t;
+    int i;
+
+    for (i = 0; i < n; i++) {
+	b = (unsigned char *)&f[i];
+	t = b[0]; b[0] = b[3]; b[3] = t;
+	t = b[1]; b[1] = b[2]; b[2] = t;
+    }
+}
+
+/* pfm_read_header: read magic, size and scale, leaving fp at the pixels */
+static int pfm_read_header(FILE *fp, char *file, int *nc, int *nx, int *ny,
+    float *scale) {
+    char tok[40];
+
+    ppm_get_token(fp, tok, sizeof tok);
+    if (!strcmp(tok, "PF")) *nc = 3;
+    else if (!strcmp(tok, "Pf")) *nc = 1;
+    else {
+	fprintf(stderr, "%s is not a valid PFM file, bad magic#\n", file);
+	return 0;
+    }
+    if (sscanf(ppm_get_token(fp, tok, sizeof tok), "%d", nx) != 1 ||
+	sscanf(ppm_get_token(fp, tok, sizeof tok), "%d", ny) != 1 ||
+	sscanf(ppm_get_token(fp, tok, sizeof tok), "%f", scale) != 1 ||
+	*nx <= 0 || *ny <= 0 || *scale == 0) {
+	    fprintf(stderr, "%s is not a valid PFM file: bad header\n", file);
+	    return 0;
+    }
+    /* ppm_get_token has already eaten the single whitespace byte */
+    return 1;
+}
+
+/* pfm_get_size: get size in pixels of PFM picture file */
+int pfm_get_size(char *file, int *nx, int *ny) {
+    FILE *fp;
+    int nc, ok;
+    float scale;
+
+    if ((fp = fopen(file, "rb")) == NULL) {
+	fprintf(stderr, "can't read PFM file %s\n", file);
+	return 0;
+    }
+    ok = pfm_read_header(fp, file, &nc, nx, ny, &scale);
+    fclose(fp);
+    return ok;
+}
+
+/*
+ * pfm_read: read a PFM file into memory.
+ * If opic!=0, then picture is read into opic->pix (after checking that
+ * size is sufficient), else a new FPic is allocated.
+ * Returns FPic pointer on success, 0 on failure.
+ */
+FPic *pfm_read(char *file, FPic *opic) {
+    FILE *fp;
+    int nc, nx, ny, y;
+    float scale;
+    FPic *p;
+
+    if ((fp = fopen(file, "rb")) == NULL) {
+	fprintf(stderr, "can't read PFM file %s\n", file);
+	return 0;
+    }
+    if (!pfm_read_header(fp, file, &nc, &nx, &ny, &scale)) {
+	fclose(fp);
+	return 0;
+    }
+
+    p = fpic_alloc(nx, ny, nc, opic);
+    printf("reading PFM file %s: %dx%d pixels\n", file, p->nx, p->ny);
+
+    /* bottom row first on disk */
+    for (y = ny-1; y >= 0; y--) {
+	if (fread(&p->pix[y*nx*nc], sizeof(PixelF), nx*nc, fp) != nx*nc) {
+	    fprintf(stderr, "premature EOF on file %s\n", file);
+	    if (p->pix != (opic ? opic->pix : 0)) free(p->pix);
+	    free(p);
+	    fclose(fp);
+	    return 0;
+	}
+    }
+    fclose(fp);
+
+    if ((scale < 0) != (pfm_little_endian() != 0))
+	pfm_swap(p->pix, nx*ny*nc);
+    return p;
+}
+
+int pfm_write(char *file, FPic *pic)
+{
+    FILE *pfm;
+    int y;
+
+    if (pic->nc != 1 && pic->nc != 3) {
+	fprintf(stderr, "pfm_write: can't write %d channel FPic\n", pic->nc);
+	return FALSE;
+    }
+
+    pfm = fopen(file, "wb");
+    if( !pfm )
+	return FALSE;
+
+    /* native byte order, flagged by the sign of the scale */
+    fprintf(pfm, "%s\n%d %d\n%s\n", pic->nc == 3 ? "PF" : "Pf",
+	pic->nx, pic->ny, pfm_little_endian() ? "-1.0" : "1.0");
+
+    for (y = pic->ny-1; y >= 0; y--) {
+	if (fwrite(&pic->pix[y*pic->nx*pic->nc], sizeof(PixelF),
+	    pic->nx*pic->nc, pfm) != pic->nx*pic->nc) {
+	    fprintf(stderr, "pfm_write: error writing %s\n", file);
+	    fclose(pfm);
+	    return FALSE;
+	}
+    }
+
+    fclose(pfm);
+    return TRUE;
+}
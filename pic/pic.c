@@ -30,6 +30,32 @@ void pic_free(Pic *p) {
     free(p);
 }
 
+/*
+ * fpic_alloc: allocate float picture memory, reusing opic->pix the same
+ * way pic_alloc does.
+ */
+FPic *fpic_alloc(int nx, int ny, int channels, FPic *opic) {
+    FPic *p;
+    int size = ny*nx*channels;
+
+    ALLOC(p, FPic, 1);
+    p->nx = nx;
+    p->ny = ny;
+    p->nc = channels;
+    if (opic && opic->nx*opic->ny*opic->nc >= p->nx*p->ny*p->nc) {
+	p->pix = opic->pix;
+	/* now opic and p have a common pix array */
+    }
+    else
+	ALLOC(p->pix, PixelF, size);
+    return p;
+}
+
+void fpic_free(FPic *p) {
+    free(p->pix);
+    free(p);
+}
+
 
 
 /*
@@ -61,6 +87,10 @@ Pic_file_format pic_file_type(char *file)
 		
     if( byte[0]=='P' && (byte[1]=='3' || byte[1]=='6') )
 			return PIC_PPM_FILE;
+    else if( byte[0]=='P' && (byte[1]=='F' || byte[1]=='f') )
+			return PIC_PFM_FILE;
+    else if( byte[0]=='#' && byte[1]=='?' )
+			return PIC_HDR_FILE;
     else if( (byte[0]==0x4d && byte[1]==0x4d) ||
 						 (byte[0]==0x49 && byte[1]==0x49) )
 			return PIC_TIFF_FILE;
@@ -76,9 +106,12 @@ Pic_file_format pic_filename_type(char *file)
     char *suff;
 
     suff = strrchr(file, '.');
+    if (!suff) return PIC_UNKNOWN_FILE;
     if (!strcmp(suff, ".jpg")) return PIC_JPEG_FILE;
     if (!strcmp(suff, ".tiff") || !strcmp(suff, ".tif")) return PIC_TIFF_FILE;
     if (!strcmp(suff, ".ppm")) return PIC_PPM_FILE;
+    if (!strcmp(suff, ".pfm")) return PIC_PFM_FILE;
+    if (!strcmp(suff, ".hdr") || !strcmp(suff, ".pic")) return PIC_HDR_FILE;
     return PIC_UNKNOWN_FILE;
 }
 
@@ -98,6 +131,14 @@ int pic_get_size(char *file, int *nx, int *ny)
     case PIC_JPEG_FILE:
 			return jpeg_get_size(file, nx, ny);
 			break;
+
+    case PIC_PFM_FILE:
+			return pfm_get_size(file, nx, ny);
+			break;
+
+    case PIC_HDR_FILE:
+			return hdr_get_size(file, nx, ny);
+			break;
 			
     default:
 			return FALSE;
@@ -160,3 +201,47 @@ int pic_write(char *file, Pic *pic, Pic_file_format format)
 			return FALSE;
     }
 }
+
+/*
+ * fpic_read: read a PFM or Radiance HDR file into a float picture.
+ * opic is reused as in pic_read.  Returns NULL on failure.
+ */
+FPic *fpic_read(char *file, FPic *opic)
+{
+	switch( pic_file_type(file) )
+		{
+    case PIC_PFM_FILE:
+			return pfm_read(file, opic);
+			break;
+
+    case PIC_HDR_FILE:
+			return hdr_read(file, opic);
+			break;
+
+    default:
+			fprintf(stderr, "fpic_read: %s is not a float picture\n", file);
+			return NULL;
+    }
+}
+
+/*
+ * fpic_write: write a float picture in the specified format
+ * returns TRUE on success, FALSE on failure
+ */
+int fpic_write(char *file, FPic *pic, Pic_file_format format)
+{
+	switch( format )
+    {
+    case PIC_PFM_FILE:
+			return pfm_write(file, pic);
+			break;
+
+    case PIC_HDR_FILE:
+			return hdr_write(file, pic);
+			break;
+
+    default:
+			fprintf(stderr, "fpic_write: can't write %s, unknown format\n", file);
+			return FALSE;
+    }
+}
@@ -29,6 +29,7 @@ typedef struct {Pixel1 r, g, b;}	Pixel1_rgb;
 typedef short                           Pixel2;
 typedef struct {Pixel2 r, g, b;}        Pixel2_rgb;
 typedef Pixel2_rgb Rgbcolor;
+typedef float PixelF;			/* float channel, unclamped */
 
 
 typedef struct {		/* PICTURE */
@@ -51,11 +52,26 @@ typedef struct {		/* PICTURE */
     /* returns channel chan of pixel (x,y) of picture pic */
     /* usually chan=0 for red, 1 for green, 2 for blue */
 
-typedef enum {PIC_TIFF_FILE, PIC_PPM_FILE, PIC_JPEG_FILE, PIC_UNKNOWN_FILE} Pic_file_format;
+typedef struct {		/* FLOAT PICTURE, for high dynamic range */
+    int nx, ny;			/* width & height, in pixels */
+    int nc;			/* channels per pixel = 1 or 3 */
+    PixelF *pix;		/* array of pixels */
+				/* same row-major layout as Pic, top row
+				    first: array[ny][nx] or array[ny][nx][3] */
+} FPic;
+
+#define FPIC_PIXEL(pic, x, y, chan) \
+    (pic)->pix[((y)*(pic)->nx+(x))*(pic)->nc+(chan)]
+    /* returns channel chan of pixel (x,y) of float picture pic */
+
+typedef enum {PIC_TIFF_FILE, PIC_PPM_FILE, PIC_JPEG_FILE, PIC_PFM_FILE,
+	      PIC_HDR_FILE, PIC_UNKNOWN_FILE} Pic_file_format;
 
 /*----------------------Allocation routines--------------------------*/
 extern Pic *pic_alloc(int nx, int ny, int bytes_per_pixel, Pic *opic);
 extern void pic_free(Pic *p);
+extern FPic *fpic_alloc(int nx, int ny, int channels, FPic *opic);
+extern void fpic_free(FPic *p);
 
 /*------------------------- I/O routines ----------------------------*/
 /*
@@ -72,11 +88,22 @@ extern int ppm_get_size(char *file, int *nx, int *ny);
 extern Pic *ppm_read(char *file, Pic *opic);
 extern int ppm_write(char *file, Pic *pic);
 
+/* float pictures: Portable Float Map and Radiance RGBE */
+extern int pfm_get_size(char *file, int *nx, int *ny);
+extern FPic *pfm_read(char *file, FPic *opic);
+extern int pfm_write(char *file, FPic *pic);
+
+extern int hdr_get_size(char *file, int *nx, int *ny);
+extern FPic *hdr_read(char *file, FPic *opic);
+extern int hdr_write(char *file, FPic *pic);
+
 extern int pic_get_size(char *file, int *nx, int *ny);
 extern Pic *pic_read(char *file, Pic *opic);
 extern int pic_write(char *file, Pic *pic, Pic_file_format format);
 extern Pic_file_format pic_file_type(char *file);
 extern Pic_file_format pic_filename_type(char *file);
+extern FPic *fpic_read(char *file, FPic *opic);
+extern int fpic_write(char *file, FPic *pic, Pic_file_format format);
 
 #ifdef __cplusplus
 }
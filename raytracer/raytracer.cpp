@@ -4,11 +4,82 @@
 #include <GLUT/glut.h>
 #include <pic.h>
 #include <string.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
 #include <cmath>
+#include <limits>
+#include <cfloat>
+#include <climits>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <stdint.h>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#if defined(__AVX__) || defined(__SSE__)
+#include <immintrin.h>
+#endif
 
-#define MAX_TRIANGLES 2000
 #define MAX_SPHERES 10
-#define MAX_LIGHTS 10
+#define MAX_LIGHTS 10000
+
+//triangles per bvh leaf before the sah builder stops splitting, and its bin count
+#define BVH_LEAF_SIZE 4
+#define BVH_BINS 16
+#define BVH_STACK 256
+
+//past BVH_SAH_DEPTH the sah builder splits at the centroid median, so a scene it
+//would peel a triangle at a time off stays within the log of its size. nodes at
+//BVH_MAX_DEPTH are leaves however much they hold, which keeps the three children
+//a wide node can add per level inside BVH_STACK
+#define BVH_SAH_DEPTH 48
+#define BVH_MAX_DEPTH 80
+
+//children per node of the collapsed bvh that rays traverse
+#define BVH_WIDTH 4
+
+//a refit bvh is rebuilt once its sah cost grows past REFIT_LIMIT times its cost
+//when built. refits hand each thread about REFIT_SUBTREES subtrees
+#define REFIT_LIMIT 1.5
+#define REFIT_SUBTREES 8
+
+//the parallel loader merges its slices' vertices in 1 << VERTEX_PARTITION_BITS
+//partitions picked by the top bits of their hash, each deduplicated on its own
+#define VERTEX_PARTITION_BITS 6
+
+//scene arena block size and alignment, arrays over ARENA_LARGE get a block each
+#define ARENA_BLOCK (4 << 20)
+#define ARENA_LARGE (ARENA_BLOCK / 4)
+#define ARENA_ALIGN 64
+
+//bvh builders
+#define BVH_NONE 0
+#define BVH_SAH 1
+#define BVH_LBVH 2
+
+//number of lights sampled from the light tree per shading point
+#define LIGHT_SAMPLES 8
+
+//scalar type for geometry and rays, build with -DRAYTRACER_FLOAT for single precision
+#ifdef RAYTRACER_FLOAT
+typedef float real;
+#else
+typedef double real;
+#endif
 
 char *filename=0;
 
@@ -17,6 +88,45 @@ char *filename=0;
 #define MODE_JPEG 2
 int mode=MODE_DISPLAY;
 
+//different integrators
+#define RENDER_PHONG 1
+#define RENDER_PATH 2
+int render_mode=RENDER_PHONG;
+
+//path tracing defaults
+#define PATH_SAMPLES 16
+#define PATH_DEPTH 5
+
+//tone mapping operators applied before the 8-bit conversion
+#define TONE_CLAMP 1
+#define TONE_REINHARD 2
+
+//seconds between checkpoints of a long render
+#define CHECKPOINT_INTERVAL 60
+
+//milliseconds -watch waits between looks at the scene file, and how long a
+//changed file has to keep its size and time before it is read
+#define WATCH_INTERVAL 100
+#define WATCH_SETTLE 200
+
+//image rows handed to a worker process at a time
+#define TILE_ROWS 8
+
+//a worker that has held a tile for WORKER_TIMEOUT_TILES times the mean tile time,
+//and at least WORKER_TIMEOUT seconds, has hung and its tile goes to another
+#define WORKER_TIMEOUT 30
+#define WORKER_TIMEOUT_TILES 10
+
+//rows traced together as one batch by the wavefront pipeline
+#define WAVEFRONT_ROWS 8
+
+//time budgeted rendering, every pixel gets this many passes before noisy pixels are favoured
+#define BUDGET_UNIFORM_PASSES 4
+#define BUDGET_MAX_SAMPLES 65536
+
+//entries in the gamma lookup table
+#define GAMMA_TABLE_SIZE 4096
+
 //you may want to make these smaller for debugging purposes
 #define WIDTH 640
 #define HEIGHT 480
@@ -26,100 +136,626 @@ int mode=MODE_DISPLAY;
 
 enum Color {RED, GREEN, BLUE};
 
+//8-bit image written by tone_map, top row first as save_jpg expects
 unsigned char buffer[HEIGHT][WIDTH][3];
 
-struct Vertex
+//render target, every sample is summed here and divided by the count when tone mapping
+float accumulation[HEIGHT][WIDTH][3];
+unsigned int sample_counts[HEIGHT][WIDTH];
+//summed squared luminance of the samples, for the per-pixel variance
+float accumulation_sq[HEIGHT][WIDTH];
+//pixels that take a sample in the current pass, and the error that picked them
+unsigned char pixel_active[HEIGHT][WIDTH];
+float pixel_error[HEIGHT * WIDTH];
+
+//tone mapping settings
+float exposure = 1.0f;
+float display_gamma = 1.0f;
+int tone_operator = TONE_CLAMP;
+unsigned char gamma_table[GAMMA_TABLE_SIZE];
+
+template <typename T>
+struct VertexT
+{
+  T position[3];
+  T color_diffuse[3];
+  T color_specular[3];
+  T normal[3];
+  T shininess;
+};
+
+//the rest of a vertex, kept apart from the positions since it is only read
+//once the closest hit is known
+template <typename T>
+struct VertexMaterialT
 {
-  double position[3];
-  double color_diffuse[3];
-  double color_specular[3];
-  double normal[3];
-  double shininess;
+  T color_diffuse[3];
+  T color_specular[3];
+  T normal[3];
+  T shininess;
 };
 
+//corners are vertex indices, so triangles sharing a vertex share its data
 typedef struct _Triangle
 {
-  struct Vertex v[3];
+  int v[3];
 } Triangle;
 
-typedef struct _Sphere
+template <typename T>
+struct SphereT
 {
-  double position[3];
-  double color_diffuse[3];
-  double color_specular[3];
-  double shininess;
-  double radius;
-} Sphere;
+  T position[3];
+  T color_diffuse[3];
+  T color_specular[3];
+  T shininess;
+  T radius;
+};
 
-typedef struct _Light
+template <typename T>
+struct LightT
 {
-  double position[3];
-  double color[3];
-} Light;
+  T position[3];
+  T color[3];
+};
 
-typedef struct _Ray
+//call prepare_ray after setting the direction
+template <typename T>
+struct RayT
 {
-  double position[3];
-  double direction[3];
-} Ray;
+  T position[3];
+  T direction[3];
+  //axes and shear for the watertight triangle test, kz is the dominant axis
+  int kx, ky, kz;
+  T shear[3];
+};
 
-typedef struct _Intersection
+template <typename T>
+struct IntersectionT
 {
-  double time;
-  double position[3];
+  T time;
+  T position[3];
   Triangle *triangle;
-  Sphere *sphere;
-} Intersection;
+  SphereT<T> *sphere;
+  //instance the triangle was hit through, -1 for the scene's own triangles
+  int instance;
+};
+
+typedef VertexT<real> Vertex;
+typedef VertexMaterialT<real> VertexMaterial;
+typedef SphereT<real> Sphere;
+typedef LightT<real> Light;
+typedef RayT<real> Ray;
+typedef IntersectionT<real> Intersection;
+
+//node of the light hierarchy, leaves hold a single light
+typedef struct _LightNode
+{
+  real bounds_min[3];
+  real bounds_max[3];
+  double power;
+  int left;
+  int right;
+  int light;
+} LightNode;
+
+//last primitive found blocking each light, kept per thread
+typedef struct _ShadowCache
+{
+  Triangle *triangle[MAX_LIGHTS];
+  int instance[MAX_LIGHTS];
+  Sphere *sphere[MAX_LIGHTS];
+  long lookups;
+  long hits;
+} ShadowCache;
+
+//node of the triangle bvh. inner nodes have count 0 and two children, leaves
+//hold count triangles starting at bvh_order[left]
+typedef struct _BVHNode
+{
+  real bounds_min[3];
+  real bounds_max[3];
+  int left;
+  int right;
+  int count;
+} BVHNode;
+
+//collapsed bvh node testing four children at once. bounds are stored by side,
+//axis and then child so each plane of all four boxes is one vector load. a child
+//with count > 0 is a leaf of bvh_order[child..child+count), count 0 is another
+//wide node and count -1 an empty slot whose box can never be hit
+typedef struct _WideNode
+{
+  real bounds[2][3][BVH_WIDTH];
+  int child[BVH_WIDTH];
+  int count[BVH_WIDTH];
+} WideNode;
+
+//wide node with its child boxes stored in Q sized steps of the box around all four,
+//so plane = origin + q * scale. planes are rounded outwards, the boxes only ever grow
+template <typename Q>
+struct QuantizedNodeT
+{
+  float origin[3];
+  float scale[3];
+  Q bounds[2][3][BVH_WIDTH];
+  int child[BVH_WIDTH];
+  int count[BVH_WIDTH];
+};
+
+typedef QuantizedNodeT<uint8_t> QuantizedNode8;
+typedef QuantizedNodeT<uint16_t> QuantizedNode16;
+
+//triangles named in a mesh definition, stored after the scene's own triangles
+//and drawn through instances. each gets a bvh of its own
+typedef struct _Mesh
+{
+  char name[64];
+  int first;
+  int count;
+  //top of its binary and wide bvh, -1 without one
+  int node;
+  int root;
+  //sah cost of its bvh when it was built, to tell how far refits have worn it
+  double cost;
+  real bounds_min[3];
+  real bounds_max[3];
+} Mesh;
+
+//a mesh placed in the scene, transform takes mesh space to the scene and inverse back.
+//rays are moved into mesh space without normalizing, so hit distances stay comparable
+typedef struct _Instance
+{
+  int mesh;
+  real transform[3][4];
+  real inverse[3][4];
+  real bounds_min[3];
+  real bounds_max[3];
+} Instance;
+
+//obj or ply file a mesh was imported from, listed after the cache header so a
+//cache made before the file changed is rebuilt
+typedef struct _ImportedFile
+{
+  char path[1024];
+  uint64_t hash;
+} ImportedFile;
+
+//block of the scene arena, bumped from the front
+typedef struct _ArenaBlock
+{
+  char *data;
+  size_t size;
+  size_t used;
+  //arrays still in it, and bytes of freed ones that can't be bumped again
+  long live;
+  size_t stranded;
+} ArenaBlock;
+
+void *arena_alloc(size_t);
+void arena_free(void *, size_t);
+
+//allocator for arrays that live as long as the scene, see arena_alloc
+template <typename T>
+struct ArenaAllocator
+{
+  typedef T value_type;
+  ArenaAllocator() {}
+  template <typename U> ArenaAllocator(const ArenaAllocator<U> &) {}
+  T *allocate(size_t n) { return (T *)arena_alloc(n * sizeof(T)); }
+  void deallocate(T *p, size_t n) { arena_free(p, n * sizeof(T)); }
+};
+
+template <typename T, typename U>
+bool operator==(const ArenaAllocator<T> &, const ArenaAllocator<U> &) { return true; }
+template <typename T, typename U>
+bool operator!=(const ArenaAllocator<T> &, const ArenaAllocator<U> &) { return false; }
+
+template <typename T>
+using SceneVector = std::vector<T, ArenaAllocator<T> >;
+
+//scene arena, emptied all at once by unload_scene. a shared block is also freed
+//once it isn't the current one and every array in it has been
+std::vector<ArenaBlock> arena_blocks;
+//shared block small arrays are bumped from, -1 before the first
+int arena_current = -1;
+std::mutex arena_lock;
+long arena_allocations = 0;
+size_t arena_in_use = 0;
+//freed inside shared blocks that are still in use
+size_t arena_stranded = 0;
 
-Triangle triangles[MAX_TRIANGLES];
+SceneVector<Triangle> triangles;
+//every distinct vertex in the scene and its meshes, deduplicated when loading.
+//positions are packed xyz on their own, the only vertex data traversal touches
+SceneVector<real> vertex_positions;
+SceneVector<VertexMaterial> vertex_materials;
+SceneVector<Mesh> meshes;
+SceneVector<Instance> instances;
+SceneVector<ImportedFile> imported_files;
 Sphere spheres[MAX_SPHERES];
 Light lights[MAX_LIGHTS];
-double ambient_light[3];
+real ambient_light[3];
 
 int num_triangles = 0;
 int num_spheres = 0;
 int num_lights = 0;
 
+SceneVector<BVHNode> bvh_nodes;
+SceneVector<int> bvh_order;
+SceneVector<WideNode> wide_nodes;
+//tops of the bvh over the scene's own triangles, -1 without one
+int bvh_root = -1;
+int wide_root = -1;
+//sah cost of the bvh at bvh_root when it was built
+double bvh_cost = 0;
+//growth in sah cost a refit bvh may reach before it is rebuilt
+double refit_limit = REFIT_LIMIT;
+//bvh over the instance boxes, leaves hold instances from instance_order
+SceneVector<BVHNode> instance_nodes;
+SceneVector<int> instance_order;
+SceneVector<QuantizedNode8> quantized8_nodes;
+SceneVector<QuantizedNode16> quantized16_nodes;
+//parse the scene with loadScene on one thread, echoing every value it reads
+bool serial_parse = false;
+//bits per quantized child plane, 0 keeps the full precision wide nodes
+int bvh_node_bits = 0;
+int bvh_builder = BVH_SAH;
+
+LightNode light_tree[2 * MAX_LIGHTS];
+int light_tree_order[MAX_LIGHTS];
+int num_light_nodes = 0;
+
+//lights sampled per shading point, 0 shades with every light
+int light_samples = LIGHT_SAMPLES;
+
+thread_local ShadowCache shadow_cache;
+//shadow cache counters summed over all threads
+std::atomic<long> shadow_cache_lookups(0);
+std::atomic<long> shadow_cache_hits(0);
+
+//rays traced by this thread and by all threads
+thread_local long rays_traced = 0;
+std::atomic<long> total_rays_traced(0);
+
+//sampling settings and progress, 0 samples picks the default for the mode
+int samples_per_pixel = 0;
+int max_depth = PATH_DEPTH;
+int num_threads = 0;
+int passes_done = 0;
+std::atomic<int> next_row(0);
+std::chrono::steady_clock::time_point render_start;
+
+//rectangle of the image to render, in image pixels from the top left, right and bottom exclusive
+int crop_left = 0;
+int crop_top = 0;
+int crop_right = WIDTH;
+int crop_bottom = HEIGHT;
+//write the crop into the image already saved under the output name instead of a cropped image
+int patch_output = 0;
+
+//wall clock budget in seconds, 0 renders every pass however long it takes
+double time_budget = 0;
+std::chrono::steady_clock::time_point deadline;
+
+//passes finished by each row, rows ahead of passes_done were restored from a checkpoint
+int row_passes[HEIGHT];
+
+//checkpointing, rows are added to the accumulation under the lock so a checkpoint never sees half a row
+char *checkpoint_file = 0;
+double checkpoint_interval = CHECKPOINT_INTERVAL;
+int resume = 0;
+std::mutex checkpoint_lock;
+std::chrono::steady_clock::time_point last_checkpoint;
+
+//worker processes, each renders the tiles the master sends it with its own threads
+typedef struct _Worker
+{
+  pid_t pid;
+  int fd;
+  //top image row of the tile it is rendering, -1 when idle, and when it was sent
+  int tile;
+  std::chrono::steady_clock::time_point sent;
+} Worker;
+
+//sent to a worker, followed by a sample index for each pixel of the rows, UINT_MAX to skip the pixel
+typedef struct _TileRequest
+{
+  int pass;
+  int first_row;
+  int rows;
+} TileRequest;
+
+//sent back, followed by red, green, blue and squared luminance for each pixel of the rows
+typedef struct _TileReply
+{
+  int first_row;
+  int rows;
+  long rays;
+  long shadow_lookups;
+  long shadow_hits;
+} TileReply;
+
+int num_workers = 0;
+std::vector<Worker> worker_processes;
+//seconds a worker may hold a tile, 0 derives it from the tiles returned so far
+double worker_timeout = 0;
+long tiles_returned = 0;
+double tile_seconds = 0;
+
+//trace paths a bounce at a time over batches of rows
+int wavefront = 0;
+
+//reorder each wavefront queue by direction octant and the morton code of the
+//ray origins before tracing it, so neighbouring rays take similar routes
+int sort_rays = 0;
+real scene_min[3];
+real scene_max[3];
+//neighbouring secondary rays in the same octant and origin cell, before and after sorting
+std::atomic<long> sorted_ray_pairs(0);
+std::atomic<long> coherent_pairs_before(0);
+std::atomic<long> coherent_pairs_after(0);
+
+//sort key of a ray and the queue entry it belongs to
+typedef struct _RayKey
+{
+  uint32_t key;
+  int index;
+} RayKey;
+
+//a path in flight in the wavefront pipeline
+typedef struct _PathState
+{
+  Ray ray;
+  Intersection hit;
+  unsigned int seed;
+  //pixel column and row within the batch
+  int x;
+  int y;
+  double throughput[3];
+  //throughput times albedo at the current hit, scaling the direct light found there
+  double weight[3];
+  double direct[3];
+  double radiance[3];
+  bool bounces;
+} PathState;
+
+//shadow ray queued by a path, its light is added to the path if nothing blocks it
+typedef struct _ShadowRay
+{
+  Ray ray;
+  real distance;
+  int light;
+  int path;
+  double contribution;
+  double pdf;
+} ShadowRay;
+
+//written ahead of the buffers in a checkpoint file
+typedef struct _CheckpointHeader
+{
+  char magic[8];
+  int width;
+  int height;
+  int render_mode;
+  int passes_done;
+  int crop[4];
+  uint64_t scene_hash;
+  int max_depth;
+  int light_samples;
+} CheckpointHeader;
+
+//parsed scene and its bvh saved under the hash of the scene file, so a rerun skips both
+char *cache_file = 0;
+
+//written ahead of the vertices, triangles, spheres, lights, meshes, instances, bvh
+//nodes and bvh order in a scene cache. triangles include the ones in meshes
+typedef struct _SceneCacheHeader
+{
+  char magic[8];
+  uint64_t scene_hash;
+  int real_size;
+  int bvh_builder;
+  int num_vertices;
+  int num_triangles;
+  int num_spheres;
+  int num_lights;
+  int num_meshes;
+  int num_instances;
+  int num_imports;
+  int num_nodes;
+  int bvh_root;
+  double bvh_cost;
+  real ambient[3];
+} SceneCacheHeader;
+
+//with -watch a finished render starts over whenever the scene file or a mesh file
+//it imports changes, refitting the bvh instead of rebuilding it when only vertices moved
+bool watch_scene = false;
+char *scene_file = 0;
+//hash of the scene file as loaded, so a checkpoint is only resumed on the same scene
+uint64_t scene_file_hash = 0;
+
+//a file the loaded scene came from, as it was when it was read
+typedef struct _WatchedFile
+{
+  char path[1024];
+  uint64_t hash;
+  time_t mtime;
+  off_t size;
+} WatchedFile;
+
+std::vector<WatchedFile> watched_files;
+//inotify descriptor watching the directories of watched_files, -1 polls them instead
+int watch_fd = -1;
+
+//constants for pushing secondary ray origins off a surface, see offset_ray_origin
+template <typename T> struct OffsetTraits;
+
+template <>
+struct OffsetTraits<float>
+{
+  typedef int32_t Int;
+  static float origin() { return 1.0f / 32.0f; }
+  static float float_scale() { return 1.0f / 65536.0f; }
+  static float int_scale() { return 256.0f; }
+};
+
+template <>
+struct OffsetTraits<double>
+{
+  typedef int64_t Int;
+  static double origin() { return 1.0 / 32.0; }
+  static double float_scale() { return std::ldexp(1.0, -45); }
+  static double int_scale() { return 256.0; }
+};
+
+//precision used when the triangle test lands exactly on an edge
+template <typename T> struct Wider { typedef double type; };
+template <> struct Wider<double> { typedef long double type; };
+
+template <typename T>
+inline T square(T x)
+{
+  return x * x;
+}
+
 void plot_pixel_display(int x,int y,unsigned char r,unsigned char g,unsigned char b);
-void plot_pixel_jpeg(int x,int y,unsigned char r,unsigned char g,unsigned char b);
-void plot_pixel(int x,int y,unsigned char r,unsigned char g,unsigned char b);
 
-void colorPixel(unsigned int, unsigned int);
-Ray cast_ray(unsigned int x, unsigned int y);
+void colorPixel(double, double, unsigned int *, double *);
+Ray cast_ray(double x, double y);
 Intersection check_spheres(Ray);
 Intersection check_triangles(Ray);
+Triangle *find_occluder(Ray, real, int *);
+Triangle *closest_in_tree(int, int, int, Ray, real *, real *);
+Triangle *occluder_in_tree(int, int, int, Ray, real);
+Triangle *closest_instanced(Ray, real *, real *, int *);
+Triangle *instanced_occluder(Ray, real, int *);
+Ray instance_ray(Ray, Instance *);
+void hit_vertices(Intersection, real [3][3]);
+void build_bvh();
+int build_bvh_range(int, int);
+int build_bvh_sah(int, int, int);
+int sah_split(int, int, int, int, real, real);
+int build_bvh_lbvh(int, int);
+void build_instances();
+int build_instance_tree(int, int);
+bool box_entry(BVHNode *, Ray, real *, real, real *);
+void build_wide_bvh();
+int collapse_bvh(int);
+template <typename T> T intersect_sphere(RayT<T>, SphereT<T> *);
+template <typename T> T intersect_triangle(RayT<T>, const T *, const T *, const T *, T *);
+real intersect_triangle(Ray, Triangle *, real *);
+real *corner_position(Triangle *, int);
+real triangle_centroid(Triangle *, int);
+template <typename T> void prepare_ray(RayT<T> *);
+template <typename T> void offset_ray_origin(T *, T *, T *);
+template <typename T> void ray_inverse(RayT<T>, T *);
+int wide_box_entry(real [2][3][BVH_WIDTH], Ray, real *, real, real *);
+template <typename N> Triangle *closest_triangle(SceneVector<N> &, int, Ray, real *, real *);
+template <typename N> Triangle *first_occluder(SceneVector<N> &, int, Ray, real);
+template <typename Q> void quantize_node(WideNode *, QuantizedNodeT<Q> *);
 bool lookForShadow(double *);
-double calcDiffuse(Ray, Intersection);
+double calcDiffuse(Ray, Intersection, unsigned int *);
+double lightContribution(Intersection, real *, int);
+Ray shadow_ray(Intersection, real *, int, real *);
+void cosine_bounce(Intersection, real *, unsigned int *, Ray *);
+bool closest_hit(Ray, Intersection *);
+void hit_surface(Ray, Intersection, real *, double *);
+void render_rows_wavefront();
+void find_scene_bounds();
+void report_arena();
+void unload_scene();
+int set_transform(Instance *, real *, real *, real *);
+void finish_scene(std::vector<Triangle> &);
+uint32_t ray_sort_key(Ray *);
+void sort_ray_keys(std::vector<RayKey> &);
+void commit_row(int, double (*)[3]);
+bool inShadow(Ray, real, int);
+void flush_thread_stats();
+int build_light_tree(int, int);
+int sample_light_tree(real *, real *, double, double *);
+double light_importance(LightNode *, real *, real *);
+double random_double(unsigned int *);
 double calcTriangleColor(Intersection, int);
 double getSphereColor(Intersection,int);
+void surfaceNormal(Intersection, real *);
+void report_stats(double);
+void draw_scene();
+void render_rows();
+void trace_path(Ray, unsigned int *, double *);
+void nextEventEstimate(Intersection, real *, unsigned int *, double *);
+void tone_map();
+void build_gamma_table();
+void show_buffer();
+unsigned int pixel_seed(unsigned int, unsigned int, unsigned int);
+int write_checkpoint();
+int read_checkpoint();
+uint64_t hash_file(char *);
+int write_scene_cache(uint64_t);
+int read_scene_cache(uint64_t);
+bool out_of_time();
+void select_noisy_pixels();
+void report_samples();
+void render_pass();
+void maybe_checkpoint();
+void start_workers();
+void stop_workers();
+void distribute_pass();
+void worker_loop(int);
+void close_inherited_fds(int);
+double refit_bvh(int);
+double refit_bvhs();
+double bvh_tree_cost(int);
+void watch_files(uint64_t);
+bool scene_changed();
+bool reload_scene();
+void restart_render();
 
 
-//draws scene
-void draw_scene()
+//prints ray throughput and shadow cache counters for a finished render
+void report_stats(double seconds)
 {
-  unsigned int x,y;
-  //simple output
-  for(x = 0; x < WIDTH; x++)
-  {
-    glPointSize(2.0);  
-    glBegin(GL_POINTS);
-    for(y = 0; y < HEIGHT; y++)
+  printf("%s precision: %.2f s, %ld rays, %.3f Mrays/s\n", sizeof(real) == sizeof(float) ? "float" : "double",
+         seconds, (long)total_rays_traced, total_rays_traced / seconds / 1e6);
+  if(shadow_cache_lookups > 0)
+    printf("shadow cache: %ld of %ld shadow rays answered by the last occluder (%.1f%%)\n",
+           (long)shadow_cache_hits, (long)shadow_cache_lookups, 100.0 * shadow_cache_hits / shadow_cache_lookups);
+  if(sorted_ray_pairs > 0)
+    printf("ray sorting: neighbouring secondary rays sharing an octant and origin cell %.1f%% before, %.1f%% after\n",
+           100.0 * coherent_pairs_before / sorted_ray_pairs, 100.0 * coherent_pairs_after / sorted_ray_pairs);
+  fflush(stdout);
+}
+
+//samples each pixel ended up with, which varies once the budget favours noisy pixels
+void report_samples()
+{
+  unsigned int fewest = UINT_MAX, most = 0;
+  double total = 0;
+  
+  for(int y = HEIGHT - crop_bottom; y < HEIGHT - crop_top; y++)
+    for(int x = crop_left; x < crop_right; x++)
     {
-      colorPixel(x,y);
+      fewest = std::min(fewest, sample_counts[y][x]);
+      most = std::max(most, sample_counts[y][x]);
+      total += sample_counts[y][x];
     }
-    glEnd();
-    glFlush();
-  }
-  printf("Done!\n"); fflush(stdout);
+  printf("samples per pixel: %.2f average, %u fewest, %u most\n", total / ((crop_right - crop_left) * (crop_bottom - crop_top)), fewest, most);
+  fflush(stdout);
 }
 
-void colorPixel(unsigned int x, unsigned int y)
+//phong shaded color seen through a point on the screen, black if nothing is hit
+void colorPixel(double x, double y, unsigned int *seed, double *color)
 {
   Intersection triIntersection;
   Intersection sphereIntersection;
   
+  color[0] = 0;
+  color[1] = 0;
+  color[2] = 0;
+  
   //create primary array
   Ray primary_ray = cast_ray(x, y);
+  rays_traced++;
   
   //check for intersections with triangles and spheres, getting intersection information
   triIntersection = check_triangles(primary_ray);
@@ -128,43 +764,31 @@ void colorPixel(unsigned int x, unsigned int y)
   //if we hit a triangle first
   if((triIntersection.time < sphereIntersection.time || sphereIntersection.time < 0) && triIntersection.time >= 0)
   {
-    double diffuseLight = calcDiffuse(primary_ray, triIntersection);
+    double diffuseLight = calcDiffuse(primary_ray, triIntersection, seed);
     double red = calcTriangleColor(triIntersection, 0);
     double green = calcTriangleColor(triIntersection, 1);
     double blue = calcTriangleColor(triIntersection, 2);
     
-    red *= (0.7 * diffuseLight + 0.3);
-    green *= (0.7 * diffuseLight + 0.3);
-    blue *= (0.7 * diffuseLight + 0.3);
-
-    red *= 255;
-    green *= 255;
-    blue *= 255;
-    
-    plot_pixel(x,y,red,green,blue);
+    color[0] = red * (0.7 * diffuseLight + 0.3);
+    color[1] = green * (0.7 * diffuseLight + 0.3);
+    color[2] = blue * (0.7 * diffuseLight + 0.3);
   }
   
   //if we hit a sphere first
   else if((sphereIntersection.time < triIntersection.time || triIntersection.time < 0) && sphereIntersection.time >= 0)
   {
-    double diffuseLight = calcDiffuse(primary_ray, sphereIntersection);
+    double diffuseLight = calcDiffuse(primary_ray, sphereIntersection, seed);
     double red = getSphereColor(sphereIntersection, 0);
     double green = getSphereColor(sphereIntersection, 1);
     double blue = getSphereColor(sphereIntersection, 2);
     
-    red *= (0.6 * diffuseLight + 0.4);
-    green *= (0.6 * diffuseLight + 0.4);
-    blue *= (0.6 * diffuseLight + 0.4);
-                                 
-    red *= 255;
-    green *= 255;
-    blue *= 255;
-                                 
-    plot_pixel(x,y,red,green,blue);
+    color[0] = red * (0.6 * diffuseLight + 0.4);
+    color[1] = green * (0.6 * diffuseLight + 0.4);
+    color[2] = blue * (0.6 * diffuseLight + 0.4);
   }
 }
 
-Ray cast_ray(unsigned int x, unsigned int y)
+Ray cast_ray(double x, double y)
 {
   double pixDirectionFactor = std::abs(2 * std::tan(fov/2.0) / HEIGHT);
   double rayLength;
@@ -176,8 +800,8 @@ Ray cast_ray(unsigned int x, unsigned int y)
   primary_ray.position[2] = 0.0;
   
   //direct ray to pixel position on screen
-  primary_ray.direction[0] = ((double)x - (WIDTH/2.0)) * pixDirectionFactor;
-  primary_ray.direction[1] = ((double)y - (HEIGHT/2.0)) * pixDirectionFactor;
+  primary_ray.direction[0] = (x - (WIDTH/2.0)) * pixDirectionFactor;
+  primary_ray.direction[1] = (y - (HEIGHT/2.0)) * pixDirectionFactor;
   primary_ray.direction[2] = -1.0;
   
   //normalize it
@@ -186,10 +810,54 @@ Ray cast_ray(unsigned int x, unsigned int y)
   primary_ray.direction[0] /= rayLength;
   primary_ray.direction[1] /= rayLength;
   primary_ray.direction[2] /= rayLength;
+  prepare_ray(&primary_ray);
   
   return primary_ray;
 }
 
+//picks the axes and shear the watertight triangle test needs for this direction
+template <typename T>
+void prepare_ray(RayT<T> *ray)
+{
+  ray->kz = 0;
+  if(std::abs(ray->direction[1]) > std::abs(ray->direction[ray->kz]))
+    ray->kz = 1;
+  if(std::abs(ray->direction[2]) > std::abs(ray->direction[ray->kz]))
+    ray->kz = 2;
+  ray->kx = (ray->kz + 1) % 3;
+  ray->ky = (ray->kx + 1) % 3;
+  //keep the winding the same when looking down the negative axis
+  if(ray->direction[ray->kz] < 0)
+    std::swap(ray->kx, ray->ky);
+
+  ray->shear[0] = ray->direction[ray->kx] / ray->direction[ray->kz];
+  ray->shear[1] = ray->direction[ray->ky] / ray->direction[ray->kz];
+  ray->shear[2] = 1 / ray->direction[ray->kz];
+}
+
+//nudges a surface point along the geometric normal n by a few ulps so rays
+//leaving it can't hit the same surface (Waechter and Binder, Ray Tracing Gems ch. 6)
+template <typename T>
+void offset_ray_origin(T *p, T *n, T *out)
+{
+  typedef typename OffsetTraits<T>::Int Int;
+
+  for(int k = 0; k < 3; k++)
+  {
+    //close to zero the ulps get too small, so use a fixed distance instead
+    if(std::abs(p[k]) < OffsetTraits<T>::origin())
+    {
+      out[k] = p[k] + OffsetTraits<T>::float_scale() * n[k];
+      continue;
+    }
+    Int step = (Int)(OffsetTraits<T>::int_scale() * n[k]);
+    Int bits;
+    memcpy(&bits, &p[k], sizeof(T));
+    bits += p[k] < 0 ? -step : step;
+    memcpy(&out[k], &bits, sizeof(T));
+  }
+}
+
 Intersection check_spheres(Ray ray)
 {
   //Intersection to be returned by value.  Initialize time to -1
@@ -197,49 +865,16 @@ Intersection check_spheres(Ray ray)
   closestHit.time = -1.0;
   closestHit.sphere = NULL;
   closestHit.triangle = NULL;
+  closestHit.instance = -1;
   
   //iterate through spheres
   for(int i = 0; i < num_spheres; i++)
   {
-    //variables used to find intersection time value via quadratic function
-    double a = (pow(ray.direction[0], 2) + pow(ray.direction[1], 2) + pow(ray.direction[2], 2));
-    
-    double b = 2.0 * ((ray.direction[0] * (ray.position[0] - spheres[i].position[0])) +
-                      (ray.direction[1] * (ray.position[1] - spheres[i].position[1])) +
-                      (ray.direction[2] * (ray.position[2] - spheres[i].position[2])));
-    
-    double c = pow((ray.position[0] - spheres[i].position[0]),2) +
-              pow((ray.position[1] - spheres[i].position[1]),2) +
-              pow((ray.position[2] - spheres[i].position[2]),2) -
-              pow(spheres[i].radius,2);
-  
-    //quadratic formula
-    double discriminant = pow(b,2) - (4 * a * c);
-    if(discriminant >= 0)
-    {
-      //calculate and compare both solutions
-      double zero1 = ((-1.0 * b) + sqrt(discriminant)) / (2.0 * a);
-      double zero2 = ((-1.0 * b) - sqrt(discriminant)) / (2.0 * a);
-
-      if(zero1 < zero2 && zero1 > 0 && (zero1 < closestHit.time || closestHit.time == -1.0))
-      {
-        closestHit.time = zero1;
-        closestHit.sphere = &spheres[i];
-      }
-      else if(zero2 < zero1 && zero2 >0 && (zero1 < closestHit.time || closestHit.time == -1.0))
-      {
-        closestHit.time = zero2;
-        closestHit.sphere = &spheres[i];
-      }
-    }
-    else if(discriminant == 0.0)
+    real time = intersect_sphere(ray, &spheres[i]);
+    if(time > 0 && (time < closestHit.time || closestHit.time == -1.0))
     {
-      double zero = (-1.0 * b) / (2.0 * a);
-      if((zero < closestHit.time || closestHit.time == -1.0) && zero >= 0)
-      {
-        closestHit.time = zero;
-        closestHit.sphere = &spheres[i];
-      }
+      closestHit.time = time;
+      closestHit.sphere = &spheres[i];
     }
   }
   
@@ -247,247 +882,3246 @@ Intersection check_spheres(Ray ray)
   closestHit.position[1] = ray.position[1] + (closestHit.time * ray.direction[1]);
   closestHit.position[2] = ray.position[2] + (closestHit.time * ray.direction[2]);
 
+  //snap the hit back onto the surface so rounding in the ray distance doesn't leave it inside
+  if(closestHit.sphere != NULL)
+  {
+    Sphere *sphere = closestHit.sphere;
+    real offset[3];
+    for(int k = 0; k < 3; k++)
+      offset[k] = closestHit.position[k] - sphere->position[k];
+    real scale = sphere->radius / std::sqrt(square(offset[0]) + square(offset[1]) + square(offset[2]));
+    for(int k = 0; k < 3; k++)
+      closestHit.position[k] = sphere->position[k] + offset[k] * scale;
+  }
+
   return closestHit;
 }
 
+//time at which the ray first crosses the sphere surface, -1 if it misses
+template <typename T>
+T intersect_sphere(RayT<T> ray, SphereT<T> *sphere)
+{
+  //variables used to find intersection time value via quadratic function
+  T a = square(ray.direction[0]) + square(ray.direction[1]) + square(ray.direction[2]);
+  
+  T b = 2 * ((ray.direction[0] * (ray.position[0] - sphere->position[0])) +
+             (ray.direction[1] * (ray.position[1] - sphere->position[1])) +
+             (ray.direction[2] * (ray.position[2] - sphere->position[2])));
+  
+  T c = square(ray.position[0] - sphere->position[0]) +
+        square(ray.position[1] - sphere->position[1]) +
+        square(ray.position[2] - sphere->position[2]) -
+        square(sphere->radius);
+
+  //quadratic formula
+  T discriminant = square(b) - (4 * a * c);
+  if(discriminant >= 0)
+  {
+    //the smaller solution is where the ray enters, the larger where it leaves
+    T zero1 = (-b - std::sqrt(discriminant)) / (2 * a);
+    T zero2 = (-b + std::sqrt(discriminant)) / (2 * a);
+    if(zero1 > 0)
+      return zero1;
+    //started inside the sphere
+    if(zero2 > 0)
+      return zero2;
+  }
+  return -1;
+}
+
 Intersection check_triangles(Ray ray)
 {
   Intersection closestHit;
   closestHit.time = -1.0;
   closestHit.triangle = NULL;
   closestHit.sphere = NULL;
+  closestHit.instance = -1;
   
-  double planeNormal[3];
-  
-  double u[3];
-  double v[3];
-  double w[3];
+  real closestBarycentric[3] = {0,0,0};
+  real closest = std::numeric_limits<real>::infinity();
   
-  double intersectionPoint[3];
+  closestHit.triangle = closest_in_tree(wide_root, 0, num_triangles, ray, &closest, closestBarycentric);
+  if(!instances.empty())
+  {
+    Triangle *instanced = closest_instanced(ray, &closest, closestBarycentric, &closestHit.instance);
+    if(instanced != NULL)
+      closestHit.triangle = instanced;
+  }
+  if(closestHit.triangle != NULL)
+    closestHit.time = closest;
+
+  if(closestHit.triangle == NULL)
+  {
+    closestHit.position[0] = ray.position[0] - ray.direction[0];
+    closestHit.position[1] = ray.position[1] - ray.direction[1];
+    closestHit.position[2] = ray.position[2] - ray.direction[2];
+    return closestHit;
+  }
+
+  //rebuild the point from the vertices, which is far more accurate than the ray distance
+  real vertices[3][3];
+  hit_vertices(closestHit, vertices);
+  for(int k = 0; k < 3; k++)
+    closestHit.position[k] = (closestBarycentric[0] * vertices[0][k]) +
+                             (closestBarycentric[1] * vertices[1][k]) +
+                             (closestBarycentric[2] * vertices[2][k]);
+
+  return closestHit;
+}
+
+//nearest triangle of triangles[first..first+count) closer than closest, through
+//the wide bvh starting at root in the selected node format, or all of them without one
+Triangle *closest_in_tree(int root, int first, int count, Ray ray, real *closest, real *closestBarycentric)
+{
+  if(root >= 0 && bvh_node_bits == 8)
+    return closest_triangle(quantized8_nodes, root, ray, closest, closestBarycentric);
+  if(root >= 0 && bvh_node_bits == 16)
+    return closest_triangle(quantized16_nodes, root, ray, closest, closestBarycentric);
+  if(root >= 0)
+    return closest_triangle(wide_nodes, root, ray, closest, closestBarycentric);
   
-  for(int i = 0; i< num_triangles; i++)
+  Triangle *closestTriangle = NULL;
+  real barycentric[3];
+  for(int i = first; i < first + count; i++)
   {
-    //calculate edges of triangle
-    //edge 1
-    u[0] = triangles[i].v[1].position[0] - triangles[i].v[0].position[0];
-    u[1] = triangles[i].v[1].position[1] - triangles[i].v[0].position[1];
-    u[2] = triangles[i].v[1].position[2] - triangles[i].v[0].position[2];
-    //edge 2
-    v[0] = triangles[i].v[2].position[0] - triangles[i].v[0].position[0];
-    v[1] = triangles[i].v[2].position[1] - triangles[i].v[0].position[1];
-    v[2] = triangles[i].v[2].position[2] - triangles[i].v[0].position[2];
-    
-    //find normal vector
-    planeNormal[0] = (u[1] * v[2]) - (u[2] * v[1]);
-    planeNormal[1] = (u[2] * v[0]) - (u[0] * v[2]);
-    planeNormal[2] = (u[0] * v[1]) - (u[1] * v[0]);
-    
-    //normalize it
-    double vectorLength = (pow(planeNormal[0],2) + pow(planeNormal[1],2) + pow(planeNormal[2],2));
-    vectorLength = sqrt(vectorLength);
-    planeNormal[0] /= vectorLength;
-    planeNormal[1] /= vectorLength;
-    planeNormal[2] /= vectorLength;
-    
-    double intersectionDenominator =((ray.direction[0] * planeNormal[0]) + (ray.direction[1] * planeNormal[1]) + (ray.direction[2] * planeNormal[2]));
-    
-    if(intersectionDenominator < -0.0005 || intersectionDenominator > 0.0005)
+    real intersectionTime = intersect_triangle(ray, &triangles[i], barycentric);
+    if(intersectionTime > 0 && intersectionTime < *closest)
     {
-      double intersectionTime = ((triangles[i].v[0].position[0] - ray.position[0]) * planeNormal[0]) + ((triangles[i].v[0].position[1] - ray.position[1]) * planeNormal[1]) + ((triangles[i].v[0].position[2] - ray.position[2]) * planeNormal[2]);
-      intersectionTime /= intersectionDenominator;
-      
-      intersectionPoint[0] = ray.position[0] + (intersectionTime * ray.direction[0]);
-      intersectionPoint[1] = ray.position[1] + (intersectionTime * ray.direction[1]);
-      intersectionPoint[2] = ray.position[2] + (intersectionTime * ray.direction[2]);
-      
-      //now check if it's in the triangle
-      w[0] = intersectionPoint[0] - triangles[i].v[0].position[0];
-      w[1] = intersectionPoint[1] - triangles[i].v[0].position[1];
-      w[2] = intersectionPoint[2] - triangles[i].v[0].position[2];
-      
-      double uv = (u[0] * v[0]) + (u[1] * v[1]) + (u[2] * v[2]);
-      double uself = pow(u[0],2) + pow(u[1],2) + pow(u[2],2);
-      double vself = pow(v[0],2) + pow(v[1],2) + pow(v[2],2);
-      double uw = (u[0] * w[0]) + (u[1] * w[1]) + (u[2] * w[2]);
-      double vw = (v[0] * w[0]) + (v[1] * w[1]) + (v[2] * w[2]);
-      
-      double s = ((uv * vw) - (vself * uw)) / (pow(uv,2) - (uself * vself));
-      double t = ((uv * uw) - (uself * vw)) / (pow(uv,2) - (uself * vself));
-      
-      if(s > 0.0005 && t > 0.0005 && (s + t) <= 1.000)
-      {
-        if(intersectionTime > 0.005 && (intersectionTime < closestHit.time || closestHit.time == -1.0))
-        {
-          closestHit.time = intersectionTime;
-          closestHit.triangle = &triangles[i];
-          closestHit.position[0] = intersectionPoint[0];
-          closestHit.position[1] = intersectionPoint[1];
-          closestHit.position[2] = intersectionPoint[2];
-        }
-      }
+      *closest = intersectionTime;
+      closestTriangle = &triangles[i];
+      closestBarycentric[0] = barycentric[0];
+      closestBarycentric[1] = barycentric[1];
+      closestBarycentric[2] = barycentric[2];
     }
-      
   }
-  return closestHit;
+  return closestTriangle;
 }
 
-double calcDiffuse(Ray ray, Intersection intersection)
+//any triangle of triangles[first..first+count) crossing the ray before maxTime, like closest_in_tree
+Triangle *occluder_in_tree(int root, int first, int count, Ray ray, real maxTime)
 {
-  double normal[3] = {0,0,0};
-  double normalLength;
-  double vectorToLight[3];
-  double vectorToLightLength;
-  double lightFactor = 0;
+  if(root >= 0 && bvh_node_bits == 8)
+    return first_occluder(quantized8_nodes, root, ray, maxTime);
+  if(root >= 0 && bvh_node_bits == 16)
+    return first_occluder(quantized16_nodes, root, ray, maxTime);
+  if(root >= 0)
+    return first_occluder(wide_nodes, root, ray, maxTime);
   
-  //calculate sphere or triangle normals
-  if(intersection.sphere != NULL)
+  real barycentric[3];
+  for(int i = first; i < first + count; i++)
   {
-    normal[0] = (intersection.position[0] - intersection.sphere->position[0]) / intersection.sphere->radius;
-    normal[1] = (intersection.position[1] - intersection.sphere->position[1]) / intersection.sphere->radius;
-    normal[2] = (intersection.position[2] - intersection.sphere->position[2]) / intersection.sphere->radius;
+    real time = intersect_triangle(ray, &triangles[i], barycentric);
+    if(time > 0 && time < maxTime)
+      return &triangles[i];
   }
-  else if (intersection.triangle != NULL)
+  return NULL;
+}
+
+//the ray in the instance's mesh space, ready for the triangle test
+Ray instance_ray(Ray ray, Instance *instance)
+{
+  Ray local;
+  
+  for(int k = 0; k < 3; k++)
   {
-    double u[3];
-    double v[3];
-      
-    //calculate edges of the triangle
-    u[0] = intersection.triangle->v[1].position[0] - intersection.triangle->v[0].position[0];
-    u[1] = intersection.triangle->v[1].position[1] - intersection.triangle->v[0].position[1];
-    u[2] = intersection.triangle->v[1].position[2] - intersection.triangle->v[0].position[2];
-      
-    v[0] = intersection.triangle->v[2].position[0] - intersection.triangle->v[0].position[0];
-    v[1] = intersection.triangle->v[2].position[1] - intersection.triangle->v[0].position[1];
-    v[2] = intersection.triangle->v[2].position[2] - intersection.triangle->v[0].position[2];
-      
-    normal[0] = (u[1] * v[2]) - (u[2] * v[1]);
-    normal[1] = (u[2] * v[0]) - (u[0] * v[2]);
-    normal[2] = (u[0] * v[1]) - (u[1] * v[0]);
-    normalLength = pow(normal[0],2) + pow(normal[1],2) + pow(normal[2],2);
-    normalLength = sqrt(normalLength);
-    normal[0] /= normalLength;
-    normal[1] /= normalLength;
-    normal[2] /= normalLength;
+    local.position[k] = instance->inverse[k][3];
+    local.direction[k] = 0;
+    for(int j = 0; j < 3; j++)
+    {
+      local.position[k] += instance->inverse[k][j] * ray.position[j];
+      local.direction[k] += instance->inverse[k][j] * ray.direction[j];
+    }
   }
+  prepare_ray(&local);
+  return local;
+}
+
+//nearest triangle of any instance closer than closest. the instance tree is
+//walked in the scene, then each mesh's own bvh in its space
+Triangle *closest_instanced(Ray ray, real *closest, real *closestBarycentric, int *closestInstance)
+{
+  int stack[BVH_STACK];
+  real stackEntry[BVH_STACK];
+  int top = 0;
+  real inverse[3];
+  real entry;
+  Triangle *closestTriangle = NULL;
   
-  //iterate through lights and factor each source in
-  for(int i = 0; i < num_lights; i++)
+  ray_inverse(ray, inverse);
+  if(box_entry(&instance_nodes[0], ray, inverse, *closest, &entry))
   {
-    //generate vector to the light source
-    Ray vectorToLight;
-    //position is just the intersection
-    vectorToLight.position[0] = intersection.position[0];
-    vectorToLight.position[1] = intersection.position[1];
-    vectorToLight.position[2] = intersection.position[2];
-    //direction based on intersection and light poistion
-    vectorToLight.direction[0] = lights[i].position[0] - intersection.position[0];
-    vectorToLight.direction[1] = lights[i].position[1] - intersection.position[1];
-    vectorToLight.direction[2] = lights[i].position[2] - intersection.position[2];
-    vectorToLightLength = pow(vectorToLight.direction[0],2) + pow(vectorToLight.direction[1],2) + pow(vectorToLight.direction[2],2);
-    vectorToLightLength = sqrt(vectorToLightLength);
-    vectorToLight.direction[0] /= vectorToLightLength;
-    vectorToLight.direction[1] /= vectorToLightLength;
-    vectorToLight.direction[2] /= vectorToLightLength;
-
-    //check to see if there is a shadow
-    Intersection triangleShadow = check_triangles(vectorToLight);
-    Intersection sphereShadow = check_spheres(vectorToLight);
-
-    if(!((triangleShadow.time > 0.005 || sphereShadow.time > 0.005) && (triangleShadow.time < vectorToLightLength && sphereShadow.time < vectorToLightLength)))
+    stack[top] = 0;
+    stackEntry[top++] = entry;
+  }
+  while(top > 0)
+  {
+    top--;
+    if(stackEntry[top] > *closest)
+      continue;
+    BVHNode *node = &instance_nodes[stack[top]];
+    if(node->count == 0)
+    {
+      //the nearer child goes on top of the stack
+      real leftEntry, rightEntry;
+      bool hitLeft = box_entry(&instance_nodes[node->left], ray, inverse, *closest, &leftEntry);
+      bool hitRight = box_entry(&instance_nodes[node->right], ray, inverse, *closest, &rightEntry);
+      bool leftFirst = hitLeft && (!hitRight || leftEntry < rightEntry);
+      if(hitLeft && !leftFirst)
+      {
+        stack[top] = node->left;
+        stackEntry[top++] = leftEntry;
+      }
+      if(hitRight)
+      {
+        stack[top] = node->right;
+        stackEntry[top++] = rightEntry;
+      }
+      if(leftFirst)
+      {
+        stack[top] = node->left;
+        stackEntry[top++] = leftEntry;
+      }
+      continue;
+    }
+    for(int i = node->left; i < node->left + node->count; i++)
     {
-      lightFactor += (normal[0] * vectorToLight.direction[0]) + (normal[1] * vectorToLight.direction[1]) + (normal[2] * vectorToLight.direction[2]);
-      //hack to fix bug with negative dot product
-      if(lightFactor < 0.005)
+      Instance *instance = &instances[instance_order[i]];
+      Mesh *mesh = &meshes[instance->mesh];
+      Triangle *triangle = closest_in_tree(mesh->root, mesh->first, mesh->count, instance_ray(ray, instance), closest, closestBarycentric);
+      if(triangle != NULL)
       {
-        lightFactor -= (normal[0] * vectorToLight.direction[0]) + (normal[1] * vectorToLight.direction[1]) + (normal[2] * vectorToLight.direction[2]);;
+        closestTriangle = triangle;
+        *closestInstance = instance_order[i];
       }
     }
   }
-  lightFactor/=num_lights;
-
-  return lightFactor;
+  return closestTriangle;
 }
 
-double calcTriangleColor(Intersection intersection, int colorIndex)
+//any instanced triangle crossing the ray before maxTime, with its instance
+Triangle *instanced_occluder(Ray ray, real maxTime, int *occluderInstance)
 {
-  double d1[3];
-  double d2[3];
-  double d3[3];
-  
-  double d1length;
-  double d2length;
-  double d3length;
-  
-  double d1Factor;
-  double d2Factor;
-  double d3Factor;
-  
-  double color;
-  
-  //calculate d1 length
-  d1[0] = intersection.position[0] - intersection.triangle->v[0].position[0];
-  d1[1] = intersection.position[1] - intersection.triangle->v[0].position[1];
-  d1[2] = intersection.position[2] - intersection.triangle->v[0].position[2];
-  d1length = pow(d1[0],2) + pow(d1[1],2) +  pow(d1[2],2);
-  d1length = sqrt(d1length);
-  
-  //calculate d2 length
-  d2[0] = intersection.position[0] - intersection.triangle->v[1].position[0];
-  d2[1] = intersection.position[1] - intersection.triangle->v[1].position[1];
-  d2[2] = intersection.position[2] - intersection.triangle->v[1].position[2];
-  d2length = pow(d2[0],2) + pow(d2[1],2) + pow(d2[2],2);
-  d2length = sqrt(d2length);
-  
-  //calculate d3 length
-  d3[0] = intersection.position[0] - intersection.triangle->v[2].position[0];
-  d3[1] = intersection.position[1] - intersection.triangle->v[2].position[1];
-  d3[2] = intersection.position[2] - intersection.triangle->v[2].position[2];
-  d3length = pow(d3[0],2) + pow(d3[1],2) + pow(d3[2],2);
-  d3length = sqrt(d3length);
+  int stack[BVH_STACK];
+  int top = 0;
+  real inverse[3];
+  real entry;
   
-  //calculate factors for coloring
-  d1Factor = d1length / (d1length + d2length + d3length);
-  d2Factor = d2length / (d1length + d2length + d3length);
-  d3Factor = d3length / (d1length + d2length + d3length);
-
-  color = (d1Factor * intersection.triangle->v[0].color_diffuse[colorIndex]) + (d2Factor * intersection.triangle->v[1].color_diffuse[colorIndex]) +  (d3Factor * intersection.triangle->v[2].color_diffuse[colorIndex]);
-  
-  return color;
+  ray_inverse(ray, inverse);
+  if(box_entry(&instance_nodes[0], ray, inverse, maxTime, &entry))
+    stack[top++] = 0;
+  while(top > 0)
+  {
+    BVHNode *node = &instance_nodes[stack[--top]];
+    if(node->count == 0)
+    {
+      if(box_entry(&instance_nodes[node->right], ray, inverse, maxTime, &entry))
+        stack[top++] = node->right;
+      if(box_entry(&instance_nodes[node->left], ray, inverse, maxTime, &entry))
+        stack[top++] = node->left;
+      continue;
+    }
+    for(int i = node->left; i < node->left + node->count; i++)
+    {
+      Instance *instance = &instances[instance_order[i]];
+      Mesh *mesh = &meshes[instance->mesh];
+      Triangle *triangle = occluder_in_tree(mesh->root, mesh->first, mesh->count, instance_ray(ray, instance), maxTime);
+      if(triangle != NULL)
+      {
+        *occluderInstance = instance_order[i];
+        return triangle;
+      }
+    }
+  }
+  return NULL;
 }
 
-double getSphereColor(Intersection intersection, int colorIndex)
+//corners of the hit triangle in the scene, moved out of mesh space for instances
+void hit_vertices(Intersection hit, real vertices[3][3])
+{
+  for(int j = 0; j < 3; j++)
+  {
+    real *corner = corner_position(hit.triangle, j);
+    if(hit.instance < 0)
+    {
+      for(int k = 0; k < 3; k++)
+        vertices[j][k] = corner[k];
+      continue;
+    }
+    Instance *instance = &instances[hit.instance];
+    for(int k = 0; k < 3; k++)
+      vertices[j][k] = instance->transform[k][0] * corner[0] + instance->transform[k][1] * corner[1] +
+                       instance->transform[k][2] * corner[2] + instance->transform[k][3];
+  }
+}
+
+//walks a wide bvh nearest child first, skipping boxes beyond the closest hit so
+//far. returns the nearest triangle with its distance in closest, NULL if none.
+//a subtree that would overflow the stack, in a tree deeper than the builders
+//make, is walked by a call of its own
+template <typename N>
+Triangle *closest_triangle(SceneVector<N> &nodes, int root, Ray ray, real *closest, real *closestBarycentric)
+{
+  int stack[BVH_STACK];
+  real stackEntry[BVH_STACK];
+  int top = 0;
+  real inverse[3];
+  real barycentric[3];
+  Triangle *closestTriangle = NULL;
+  
+  ray_inverse(ray, inverse);
+  stack[top] = root;
+  stackEntry[top++] = 0;
+  while(top > 0)
+  {
+    top--;
+    if(stackEntry[top] > *closest)
+      continue;
+    N *node = &nodes[stack[top]];
+    real entry[BVH_WIDTH];
+    int hits = node_box_entry(node, ray, inverse, *closest, entry);
+    if(hits == 0)
+      continue;
+    
+    //children that were hit, sorted nearest first
+    int order[BVH_WIDTH];
+    int count = 0;
+    for(int i = 0; i < BVH_WIDTH; i++)
+      if(hits & (1 << i))
+      {
+        int j = count++;
+        for(; j > 0 && entry[order[j - 1]] > entry[i]; j--)
+          order[j] = order[j - 1];
+        order[j] = i;
+      }
+    
+    //leaves are tested straight away, nearest first so the later ones can be culled
+    for(int j = 0; j < count; j++)
+    {
+      int i = order[j];
+      if(node->count[i] <= 0 || entry[i] > *closest)
+        continue;
+      for(int k = node->child[i]; k < node->child[i] + node->count[i]; k++)
+      {
+        Triangle *triangle = &triangles[bvh_order[k]];
+        real intersectionTime = intersect_triangle(ray, triangle, barycentric);
+        if(intersectionTime > 0 && intersectionTime < *closest)
+        {
+          *closest = intersectionTime;
+          closestTriangle = triangle;
+          closestBarycentric[0] = barycentric[0];
+          closestBarycentric[1] = barycentric[1];
+          closestBarycentric[2] = barycentric[2];
+        }
+      }
+    }
+    //and inner nodes pushed farthest first so the nearest is popped next
+    for(int j = count - 1; j >= 0; j--)
+    {
+      int i = order[j];
+      if(node->count[i] == 0 && entry[i] <= *closest)
+      {
+        if(top == BVH_STACK)
+        {
+          Triangle *triangle = closest_triangle(nodes, node->child[i], ray, closest, closestBarycentric);
+          if(triangle != NULL)
+            closestTriangle = triangle;
+          continue;
+        }
+        stack[top] = node->child[i];
+        stackEntry[top++] = entry[i];
+      }
+    }
+  }
+  return closestTriangle;
+}
+
+//any triangle crossing the ray before maxTime, for shadow rays, NULL if there is none.
+//instance is set to the instance it was found through, -1 for the scene's own triangles
+Triangle *find_occluder(Ray ray, real maxTime, int *instance)
+{
+  *instance = -1;
+  Triangle *occluder = occluder_in_tree(wide_root, 0, num_triangles, ray, maxTime);
+  if(occluder == NULL && !instances.empty())
+    occluder = instanced_occluder(ray, maxTime, instance);
+  return occluder;
+}
+
+//find_occluder's walk of a wide bvh, any hit will do so children are visited in whatever order.
+//like closest_triangle it calls itself for a subtree the stack has no room for
+template <typename N>
+Triangle *first_occluder(SceneVector<N> &nodes, int root, Ray ray, real maxTime)
+{
+  int stack[BVH_STACK];
+  int top = 0;
+  real inverse[3];
+  real entry[BVH_WIDTH];
+  real barycentric[3];
+  
+  ray_inverse(ray, inverse);
+  stack[top++] = root;
+  while(top > 0)
+  {
+    N *node = &nodes[stack[--top]];
+    int hits = node_box_entry(node, ray, inverse, maxTime, entry);
+    for(int i = 0; i < BVH_WIDTH; i++)
+    {
+      if(!(hits & (1 << i)))
+        continue;
+      if(node->count[i] == 0)
+      {
+        if(top == BVH_STACK)
+        {
+          Triangle *occluder = first_occluder(nodes, node->child[i], ray, maxTime);
+          if(occluder != NULL)
+            return occluder;
+          continue;
+        }
+        stack[top++] = node->child[i];
+        continue;
+      }
+      for(int k = node->child[i]; k < node->child[i] + node->count[i]; k++)
+      {
+        real time = intersect_triangle(ray, &triangles[bvh_order[k]], barycentric);
+        if(time > 0 && time < maxTime)
+          return &triangles[bvh_order[k]];
+      }
+    }
+  }
+  return NULL;
+}
+
+//reciprocal of the ray direction for the slab tests, infinite along flat axes
+template <typename T>
+void ray_inverse(RayT<T> ray, T *inverse)
+{
+  for(int k = 0; k < 3; k++)
+    inverse[k] = 1 / ray.direction[k];
+}
+
+//distance at which the ray enters a binary node's box, false if it misses or enters
+//after maxTime. one box at a time is fine for the few nodes over instances
+bool box_entry(BVHNode *node, Ray ray, real *inverse, real maxTime, real *entry)
+{
+  const real widen = 1 + 2 * (3 * std::numeric_limits<real>::epsilon() / 2) / (1 - 3 * std::numeric_limits<real>::epsilon() / 2);
+  real enter = 0;
+  real leave = maxTime;
+  
+  for(int k = 0; k < 3; k++)
+  {
+    real t0 = (node->bounds_min[k] - ray.position[k]) * inverse[k];
+    real t1 = (node->bounds_max[k] - ray.position[k]) * inverse[k];
+    if(inverse[k] < 0)
+      std::swap(t0, t1);
+    //max and min keep the old value when the slab gives nan, for rays in its plane
+    enter = std::max(enter, t0);
+    leave = std::min(leave, t1 * widen);
+  }
+  *entry = enter;
+  return enter <= leave;
+}
+
+//slab test of the ray against the four child boxes of a wide node, bit i of the result is
+//set when it enters child i before maxTime, with the distance in entry[i]. the far
+//distance is widened by a few ulps so rounding can't cull a box the watertight
+//triangle test would hit (Ize 2013). each axis loads the near planes and the far
+//planes of all children in one go, so the sign of the direction picks the side
+int wide_box_entry(real bounds[2][3][BVH_WIDTH], Ray ray, real *inverse, real maxTime, real *entry)
+{
+  const real widen = 1 + 2 * (3 * std::numeric_limits<real>::epsilon() / 2) / (1 - 3 * std::numeric_limits<real>::epsilon() / 2);
+#if defined(__AVX__) && !defined(RAYTRACER_FLOAT)
+  //four doubles per ymm register
+  __m256d enter = _mm256_setzero_pd();
+  __m256d leave = _mm256_set1_pd(maxTime);
+  for(int k = 0; k < 3; k++)
+  {
+    int side = inverse[k] < 0;
+    __m256d position = _mm256_set1_pd(ray.position[k]);
+    __m256d scale = _mm256_set1_pd(inverse[k]);
+    __m256d t0 = _mm256_mul_pd(_mm256_sub_pd(_mm256_loadu_pd(bounds[side][k]), position), scale);
+    __m256d t1 = _mm256_mul_pd(_mm256_sub_pd(_mm256_loadu_pd(bounds[1 - side][k]), position), scale);
+    //max and min return their second operand for nan, keeping the old value for rays in a slab's plane
+    enter = _mm256_max_pd(t0, enter);
+    leave = _mm256_min_pd(_mm256_mul_pd(t1, _mm256_set1_pd(widen)), leave);
+  }
+  _mm256_storeu_pd(entry, enter);
+  return _mm256_movemask_pd(_mm256_cmp_pd(enter, leave, _CMP_LE_OQ));
+#elif defined(__SSE__) && defined(RAYTRACER_FLOAT)
+  //four floats per xmm register
+  __m128 enter = _mm_setzero_ps();
+  __m128 leave = _mm_set1_ps(maxTime);
+  for(int k = 0; k < 3; k++)
+  {
+    int side = inverse[k] < 0;
+    __m128 position = _mm_set1_ps(ray.position[k]);
+    __m128 scale = _mm_set1_ps(inverse[k]);
+    __m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(bounds[side][k]), position), scale);
+    __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(bounds[1 - side][k]), position), scale);
+    enter = _mm_max_ps(t0, enter);
+    leave = _mm_min_ps(_mm_mul_ps(t1, _mm_set1_ps(widen)), leave);
+  }
+  _mm_storeu_ps(entry, enter);
+  return _mm_movemask_ps(_mm_cmple_ps(enter, leave));
+#else
+  int hits = 0;
+  for(int i = 0; i < BVH_WIDTH; i++)
+  {
+    real enter = 0;
+    real leave = maxTime;
+    for(int k = 0; k < 3; k++)
+    {
+      int side = inverse[k] < 0;
+      real t0 = (bounds[side][k][i] - ray.position[k]) * inverse[k];
+      real t1 = (bounds[1 - side][k][i] - ray.position[k]) * inverse[k];
+      //max and min keep the old value when the slab gives nan, for rays in its plane
+      enter = std::max(enter, t0);
+      leave = std::min(leave, t1 * widen);
+    }
+    entry[i] = enter;
+    if(enter <= leave)
+      hits |= 1 << i;
+  }
+  return hits;
+#endif
+}
+
+inline int node_box_entry(WideNode *node, Ray ray, real *inverse, real maxTime, real *entry)
+{
+  return wide_box_entry(node->bounds, ray, inverse, maxTime, entry);
+}
+
+#if defined(__AVX__) && !defined(RAYTRACER_FLOAT)
+//four quantized planes widened to doubles
+inline __m256d quantized_planes(uint8_t *q)
+{
+  int32_t bytes;
+  memcpy(&bytes, q, sizeof(bytes));
+  return _mm256_cvtepi32_pd(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(bytes)));
+}
+
+inline __m256d quantized_planes(uint16_t *q)
+{
+  return _mm256_cvtepi32_pd(_mm_cvtepu16_epi32(_mm_loadl_epi64((__m128i *)q)));
+}
+#endif
+
+//expands the quantized planes and tests them like a full node
+template <typename Q>
+int node_box_entry(QuantizedNodeT<Q> *node, Ray ray, real *inverse, real maxTime, real *entry)
+{
+  real bounds[2][3][BVH_WIDTH];
+  
+  for(int side = 0; side < 2; side++)
+    for(int k = 0; k < 3; k++)
+    {
+#if defined(__AVX__) && !defined(RAYTRACER_FLOAT)
+      __m256d planes = _mm256_mul_pd(quantized_planes(node->bounds[side][k]), _mm256_set1_pd(node->scale[k]));
+      _mm256_storeu_pd(bounds[side][k], _mm256_add_pd(_mm256_set1_pd(node->origin[k]), planes));
+#else
+      for(int i = 0; i < BVH_WIDTH; i++)
+        bounds[side][k][i] = (real)node->origin[k] + (real)node->bounds[side][k][i] * (real)node->scale[k];
+#endif
+    }
+  return wide_box_entry(bounds, ray, inverse, maxTime, entry);
+}
+
+//time at which the ray crosses the triangle, -1 if it misses. Watertight, so
+//rays through a shared edge hit one of the two triangles (Woop et al. 2013)
+template <typename T>
+T intersect_triangle(RayT<T> ray, const T *p0, const T *p1, const T *p2, T *barycentric)
+{
+  T a[3];
+  T b[3];
+  T c[3];
+
+  //vertices relative to the ray origin
+  for(int k = 0; k < 3; k++)
+  {
+    a[k] = p0[k] - ray.position[k];
+    b[k] = p1[k] - ray.position[k];
+    c[k] = p2[k] - ray.position[k];
+  }
+
+  //shear so the ray runs down the z axis
+  T ax = a[ray.kx] - (ray.shear[0] * a[ray.kz]);
+  T ay = a[ray.ky] - (ray.shear[1] * a[ray.kz]);
+  T bx = b[ray.kx] - (ray.shear[0] * b[ray.kz]);
+  T by = b[ray.ky] - (ray.shear[1] * b[ray.kz]);
+  T cx = c[ray.kx] - (ray.shear[0] * c[ray.kz]);
+  T cy = c[ray.ky] - (ray.shear[1] * c[ray.kz]);
+
+  //2D edge functions around the origin
+  T u = (cx * by) - (cy * bx);
+  T v = (ax * cy) - (ay * cx);
+  T w = (bx * ay) - (by * ax);
+
+  //exactly on an edge, so redo it in more precision to get the sign right
+  if(u == 0 || v == 0 || w == 0)
+  {
+    typedef typename Wider<T>::type W;
+    u = (T)(((W)cx * (W)by) - ((W)cy * (W)bx));
+    v = (T)(((W)ax * (W)cy) - ((W)ay * (W)cx));
+    w = (T)(((W)bx * (W)ay) - ((W)by * (W)ax));
+  }
+
+  //inside when all three agree in sign, edges count so there are no cracks
+  if((u < 0 || v < 0 || w < 0) && (u > 0 || v > 0 || w > 0))
+    return -1;
+
+  T determinant = u + v + w;
+  if(determinant == 0)
+    return -1;
+
+  //scaled distance, must be in front of the ray before dividing
+  T az = ray.shear[2] * a[ray.kz];
+  T bz = ray.shear[2] * b[ray.kz];
+  T cz = ray.shear[2] * c[ray.kz];
+  T scaledTime = (u * az) + (v * bz) + (w * cz);
+  if((determinant < 0 && scaledTime >= 0) || (determinant > 0 && scaledTime <= 0))
+    return -1;
+
+  barycentric[0] = u / determinant;
+  barycentric[1] = v / determinant;
+  barycentric[2] = w / determinant;
+  return scaledTime / determinant;
+}
+
+real intersect_triangle(Ray ray, Triangle *triangle, real *barycentric)
+{
+  return intersect_triangle(ray, corner_position(triangle, 0), corner_position(triangle, 1), corner_position(triangle, 2), barycentric);
+}
+
+double calcDiffuse(Ray ray, Intersection intersection, unsigned int *seed)
+{
+  real normal[3];
+  double lightFactor = 0;
+  
+  surfaceNormal(intersection, normal);
+  
+  //few lights, or sampling switched off, so shade with every light. a light behind
+  //the surface adds nothing rather than darkening it, in both branches, so the
+  //sampled sum estimates the same thing as this one
+  if(light_samples <= 0 || num_lights <= light_samples)
+  {
+    //iterate through lights and factor each source in
+    for(int i = 0; i < num_lights; i++)
+      lightFactor += std::max(0.0, lightContribution(intersection, normal, i));
+  }
+  //otherwise estimate the sum over all lights from a few picked by the light tree
+  else
+  {
+    for(int i = 0; i < light_samples; i++)
+    {
+      double pdf;
+      int light = sample_light_tree(intersection.position, normal, random_double(seed), &pdf);
+      //walked into a branch where no light faces this point
+      if(light < 0)
+        continue;
+      lightFactor += std::max(0.0, lightContribution(intersection, normal, light)) / pdf;
+    }
+    lightFactor /= light_samples;
+  }
+  lightFactor/=num_lights;
+
+  return lightFactor;
+}
+
+//unit geometric normal of the sphere or triangle that was hit
+void surfaceNormal(Intersection intersection, real *normal)
+{
+  real normalLength;
+  
+  //calculate sphere or triangle normals
+  normal[0] = 0;
+  normal[1] = 0;
+  normal[2] = 0;
+  if(intersection.sphere != NULL)
+  {
+    normal[0] = (intersection.position[0] - intersection.sphere->position[0]) / intersection.sphere->radius;
+    normal[1] = (intersection.position[1] - intersection.sphere->position[1]) / intersection.sphere->radius;
+    normal[2] = (intersection.position[2] - intersection.sphere->position[2]) / intersection.sphere->radius;
+  }
+  else if (intersection.triangle != NULL)
+  {
+    real u[3];
+    real v[3];
+    real vertices[3][3];
+    hit_vertices(intersection, vertices);
+      
+    //calculate edges of the triangle
+    u[0] = vertices[1][0] - vertices[0][0];
+    u[1] = vertices[1][1] - vertices[0][1];
+    u[2] = vertices[1][2] - vertices[0][2];
+      
+    v[0] = vertices[2][0] - vertices[0][0];
+    v[1] = vertices[2][1] - vertices[0][1];
+    v[2] = vertices[2][2] - vertices[0][2];
+      
+    normal[0] = (u[1] * v[2]) - (u[2] * v[1]);
+    normal[1] = (u[2] * v[0]) - (u[0] * v[2]);
+    normal[2] = (u[0] * v[1]) - (u[1] * v[0]);
+    normalLength = pow(normal[0],2) + pow(normal[1],2) + pow(normal[2],2);
+    normalLength = sqrt(normalLength);
+    normal[0] /= normalLength;
+    normal[1] /= normalLength;
+    normal[2] /= normalLength;
+  }
+}
+
+//dot product between the normal and the direction to light i, or 0 if the light is blocked
+double lightContribution(Intersection intersection, real *normal, int i)
+{
+  real vectorToLightLength;
+  Ray vectorToLight = shadow_ray(intersection, normal, i, &vectorToLightLength);
+
+  //check to see if there is a shadow
+  rays_traced++;
+  if(inShadow(vectorToLight, vectorToLightLength, i))
+    return 0.0;
+
+  return (normal[0] * vectorToLight.direction[0]) + (normal[1] * vectorToLight.direction[1]) + (normal[2] * vectorToLight.direction[2]);
+}
+
+//ray from just off the surface toward light i, its length is the distance to the light
+Ray shadow_ray(Intersection intersection, real *normal, int i, real *length)
+{
+  real vectorToLightLength;
+
+  //generate vector to the light source
+  Ray vectorToLight;
+  //start just off the surface, on the side the light is on
+  real side = ((lights[i].position[0] - intersection.position[0]) * normal[0]) +
+              ((lights[i].position[1] - intersection.position[1]) * normal[1]) +
+              ((lights[i].position[2] - intersection.position[2]) * normal[2]);
+  real offsetNormal[3] = {normal[0], normal[1], normal[2]};
+  if(side < 0)
+  {
+    offsetNormal[0] = -normal[0];
+    offsetNormal[1] = -normal[1];
+    offsetNormal[2] = -normal[2];
+  }
+  offset_ray_origin(intersection.position, offsetNormal, vectorToLight.position);
+  //direction based on the ray origin and light poistion
+  vectorToLight.direction[0] = lights[i].position[0] - vectorToLight.position[0];
+  vectorToLight.direction[1] = lights[i].position[1] - vectorToLight.position[1];
+  vectorToLight.direction[2] = lights[i].position[2] - vectorToLight.position[2];
+  vectorToLightLength = pow(vectorToLight.direction[0],2) + pow(vectorToLight.direction[1],2) + pow(vectorToLight.direction[2],2);
+  vectorToLightLength = sqrt(vectorToLightLength);
+  vectorToLight.direction[0] /= vectorToLightLength;
+  vectorToLight.direction[1] /= vectorToLightLength;
+  vectorToLight.direction[2] /= vectorToLightLength;
+  prepare_ray(&vectorToLight);
+  *length = vectorToLightLength;
+  return vectorToLight;
+}
+
+//true if anything lies between the ray origin and the light at the given distance
+bool inShadow(Ray ray, real lightDistance, int light)
+{
+  ShadowCache *cache = &shadow_cache;
+  cache->lookups++;
+
+  //neighbouring points are usually blocked by the same primitive, so try it first
+  if(cache->triangle[light] != NULL)
+  {
+    real barycentric[3];
+    int instance = cache->instance[light];
+    real time = intersect_triangle(instance < 0 ? ray : instance_ray(ray, &instances[instance]), cache->triangle[light], barycentric);
+    if(time > 0 && time < lightDistance)
+    {
+      cache->hits++;
+      return true;
+    }
+  }
+  else if(cache->sphere[light] != NULL)
+  {
+    real time = intersect_sphere(ray, cache->sphere[light]);
+    if(time > 0 && time < lightDistance)
+    {
+      cache->hits++;
+      return true;
+    }
+  }
+
+  //search the whole scene and remember what was found
+  Triangle *occluder = find_occluder(ray, lightDistance, &cache->instance[light]);
+  cache->triangle[light] = occluder;
+  cache->sphere[light] = NULL;
+  if(occluder != NULL)
+    return true;
+
+  Intersection sphereShadow = check_spheres(ray);
+  if(sphereShadow.time > 0 && sphereShadow.time < lightDistance)
+  {
+    cache->sphere[light] = sphereShadow.sphere;
+    return true;
+  }
+  return false;
+}
+
+//adds this thread's ray and shadow cache counters to the totals
+void flush_thread_stats()
+{
+  total_rays_traced += rays_traced;
+  rays_traced = 0;
+  shadow_cache_lookups += shadow_cache.lookups;
+  shadow_cache_hits += shadow_cache.hits;
+  shadow_cache.lookups = 0;
+  shadow_cache.hits = 0;
+}
+
+//true for triangles whose centroid falls left of the sah split bin
+struct CentroidBinLess
+{
+  int axis;
+  real low;
+  real extent;
+  int split;
+  CentroidBinLess(int a, real l, real e, int s) : axis(a), low(l), extent(e), split(s) {}
+  bool operator()(int i) const
+  {
+    real centroid = triangle_centroid(&triangles[i], axis);
+    return std::min(BVH_BINS - 1, (int)((centroid - low) / extent * BVH_BINS)) < split;
+  }
+};
+
+//orders triangles by centroid along one axis for the median split deep in the sah build
+struct CentroidAxisLess
+{
+  int axis;
+  CentroidAxisLess(int a) : axis(a) {}
+  bool operator()(int a, int b) const { return triangle_centroid(&triangles[a], axis) < triangle_centroid(&triangles[b], axis); }
+};
+
+//orders lights along one axis while splitting the light tree
+struct LightAxisLess
+{
+  int axis;
+  LightAxisLess(int a) : axis(a) {}
+  bool operator()(int a, int b) const { return lights[a].position[axis] < lights[b].position[axis]; }
+};
+
+//builds the light tree over light_tree_order[start..end), returns the node index
+int build_light_tree(int start, int end)
+{
+  int node = num_light_nodes++;
+  int axis = 0;
+
+  //bound the lights in this range
+  for(int j = 0; j < 3; j++)
+  {
+    light_tree[node].bounds_min[j] = lights[light_tree_order[start]].position[j];
+    light_tree[node].bounds_max[j] = lights[light_tree_order[start]].position[j];
+  }
+  for(int i = start + 1; i < end; i++)
+  {
+    for(int j = 0; j < 3; j++)
+    {
+      light_tree[node].bounds_min[j] = std::min(light_tree[node].bounds_min[j], lights[light_tree_order[i]].position[j]);
+      light_tree[node].bounds_max[j] = std::max(light_tree[node].bounds_max[j], lights[light_tree_order[i]].position[j]);
+    }
+  }
+  //every light adds the same weight to lightFactor regardless of color
+  light_tree[node].power = end - start;
+
+  if(end - start == 1)
+  {
+    light_tree[node].left = -1;
+    light_tree[node].right = -1;
+    light_tree[node].light = light_tree_order[start];
+    return node;
+  }
+
+  //median split along the longest axis
+  for(int j = 1; j < 3; j++)
+  {
+    if(light_tree[node].bounds_max[j] - light_tree[node].bounds_min[j] > light_tree[node].bounds_max[axis] - light_tree[node].bounds_min[axis])
+      axis = j;
+  }
+  int mid = (start + end) / 2;
+  std::nth_element(light_tree_order + start, light_tree_order + mid, light_tree_order + end, LightAxisLess(axis));
+
+  int left = build_light_tree(start, mid);
+  int right = build_light_tree(mid, end);
+  light_tree[node].left = left;
+  light_tree[node].right = right;
+  light_tree[node].light = -1;
+  return node;
+}
+
+//upper bound on the contribution of a light tree node to a shading point
+double light_importance(LightNode *node, real *position, real *normal)
+{
+  double toCenter[3];
+  double radius = 0;
+  double distance = 0;
+
+  for(int j = 0; j < 3; j++)
+  {
+    toCenter[j] = (node->bounds_min[j] + node->bounds_max[j]) / 2.0 - position[j];
+    radius += pow(node->bounds_max[j] - node->bounds_min[j], 2);
+    distance += pow(toCenter[j], 2);
+  }
+  radius = sqrt(radius) / 2.0;
+  distance = sqrt(distance);
+
+  //point is inside the bounding sphere, any direction is possible
+  if(distance <= radius)
+    return node->power;
+
+  //largest cosine between the normal and the cone around the node
+  double cosAngle = ((normal[0] * toCenter[0]) + (normal[1] * toCenter[1]) + (normal[2] * toCenter[2])) / distance;
+  double sinHalf = radius / distance;
+  double cosHalf = sqrt(1.0 - pow(sinHalf, 2));
+  if(cosAngle >= cosHalf)
+    return node->power;
+
+  double sinAngle = sqrt(std::max(0.0, 1.0 - pow(cosAngle, 2)));
+  double cosBound = (cosAngle * cosHalf) + (sinAngle * sinHalf);
+  if(cosBound <= 0)
+    return 0.0;
+  return node->power * cosBound;
+}
+
+//walks the light tree choosing children by importance, returns the light and its probability
+int sample_light_tree(real *position, real *normal, double u, double *pdf)
+{
+  int node = 0;
+  *pdf = 1.0;
+
+  while(light_tree[node].left >= 0)
+  {
+    double left = light_importance(&light_tree[light_tree[node].left], position, normal);
+    double right = light_importance(&light_tree[light_tree[node].right], position, normal);
+    if(left + right <= 0)
+      return -1;
+
+    //reuse the random number for the next level
+    double pLeft = left / (left + right);
+    if(u < pLeft)
+    {
+      u /= pLeft;
+      *pdf *= pLeft;
+      node = light_tree[node].left;
+    }
+    else
+    {
+      u = (u - pLeft) / (1.0 - pLeft);
+      *pdf *= 1.0 - pLeft;
+      node = light_tree[node].right;
+    }
+    u = std::min(u, 0.999999);
+  }
+  return light_tree[node].light;
+}
+
+//xorshift generator, returns a value in [0,1)
+double random_double(unsigned int *seed)
+{
+  *seed ^= *seed << 13;
+  *seed ^= *seed >> 17;
+  *seed ^= *seed << 5;
+  return *seed / 4294967296.0;
+}
+
+double calcTriangleColor(Intersection intersection, int colorIndex)
+{
+  real d1[3];
+  real d2[3];
+  real d3[3];
+  
+  real d1length;
+  real d2length;
+  real d3length;
+  
+  double d1Factor;
+  double d2Factor;
+  double d3Factor;
+  
+  double color;
+  
+  real vertices[3][3];
+  hit_vertices(intersection, vertices);
+  
+  //calculate d1 length
+  d1[0] = intersection.position[0] - vertices[0][0];
+  d1[1] = intersection.position[1] - vertices[0][1];
+  d1[2] = intersection.position[2] - vertices[0][2];
+  d1length = pow(d1[0],2) + pow(d1[1],2) +  pow(d1[2],2);
+  d1length = sqrt(d1length);
+  
+  //calculate d2 length
+  d2[0] = intersection.position[0] - vertices[1][0];
+  d2[1] = intersection.position[1] - vertices[1][1];
+  d2[2] = intersection.position[2] - vertices[1][2];
+  d2length = pow(d2[0],2) + pow(d2[1],2) + pow(d2[2],2);
+  d2length = sqrt(d2length);
+  
+  //calculate d3 length
+  d3[0] = intersection.position[0] - vertices[2][0];
+  d3[1] = intersection.position[1] - vertices[2][1];
+  d3[2] = intersection.position[2] - vertices[2][2];
+  d3length = pow(d3[0],2) + pow(d3[1],2) + pow(d3[2],2);
+  d3length = sqrt(d3length);
+  
+  //calculate factors for coloring
+  d1Factor = d1length / (d1length + d2length + d3length);
+  d2Factor = d2length / (d1length + d2length + d3length);
+  d3Factor = d3length / (d1length + d2length + d3length);
+
+  color = (d1Factor * vertex_materials[intersection.triangle->v[0]].color_diffuse[colorIndex]) + (d2Factor * vertex_materials[intersection.triangle->v[1]].color_diffuse[colorIndex]) +  (d3Factor * vertex_materials[intersection.triangle->v[2]].color_diffuse[colorIndex]);
+  
+  return color;
+}
+
+double getSphereColor(Intersection intersection, int colorIndex)
 {
   return intersection.sphere->color_diffuse[colorIndex];
 }
 
-void plot_pixel_display(int x,int y,unsigned char r,unsigned char g,unsigned char b)
+//renders one more sample for every pixel, split by rows across the threads
+void draw_scene()
+{
+  last_checkpoint = std::chrono::steady_clock::now();
+  if(time_budget > 0 && passes_done >= BUDGET_UNIFORM_PASSES)
+    select_noisy_pixels();
+  if(num_workers > 0)
+    distribute_pass();
+  else
+    render_pass();
+  passes_done++;
+}
+
+//renders the rows of the pass in this process
+void render_pass()
+{
+  std::vector<std::thread> workers;
+  
+  void (*render)() = wavefront && render_mode == RENDER_PATH ? render_rows_wavefront : render_rows;
+  
+  next_row = 0;
+  for(int i = 1; i < num_threads; i++)
+    workers.push_back(std::thread(render));
+  //the main thread takes rows too
+  render();
+  for(unsigned int i = 0; i < workers.size(); i++)
+    workers[i].join();
+}
+
+//shades one sample in each pixel of the rows this thread claims
+void render_rows()
+{
+  int row;
+  while((row = next_row++) < crop_bottom - crop_top)
+  {
+    //accumulation rows count up from the bottom of the image
+    int y = HEIGHT - crop_bottom + row;
+    double row_radiance[WIDTH][3];
+
+    //already rendered before the checkpoint we resumed from
+    if(row_passes[y] > passes_done)
+      continue;
+    //leave the rest of the pass once the budget is spent
+    if(out_of_time())
+      break;
+    for(int x = crop_left; x < crop_right; x++)
+    {
+      if(!pixel_active[y][x])
+        continue;
+      unsigned int seed = pixel_seed(x, y, sample_counts[y][x]);
+      double *radiance = row_radiance[x];
+      double sampleX = x;
+      double sampleY = y;
+      
+      //jitter inside the pixel so several samples also antialias
+      if(samples_per_pixel > 1)
+      {
+        sampleX += random_double(&seed) - 0.5;
+        sampleY += random_double(&seed) - 0.5;
+      }
+      if(render_mode == RENDER_PATH)
+        trace_path(cast_ray(sampleX, sampleY), &seed, radiance);
+      else
+        colorPixel(sampleX, sampleY, &seed, radiance);
+    }
+    commit_row(y, row_radiance);
+  }
+  flush_thread_stats();
+}
+
+//runs body(begin, end) over equal slices of [0, n) on num_threads threads
+template <typename F>
+void parallel_for(int n, F body)
+{
+  std::vector<std::thread> threads;
+  int slices = std::max(1, std::min(num_threads, n));
+  
+  for(int i = 1; i < slices; i++)
+    threads.push_back(std::thread(body, (int)((long)n * i / slices), (int)((long)n * (i + 1) / slices)));
+  body(0, (int)((long)n / slices));
+  for(unsigned int i = 0; i < threads.size(); i++)
+    threads[i].join();
+}
+
+//position of one corner in the shared vertex positions
+real *corner_position(Triangle *triangle, int corner)
+{
+  return &vertex_positions[3 * triangle->v[corner]];
+}
+
+real triangle_centroid(Triangle *triangle, int axis)
+{
+  return (corner_position(triangle, 0)[axis] + corner_position(triangle, 1)[axis] + corner_position(triangle, 2)[axis]) / 3;
+}
+
+void triangle_bounds(Triangle *triangle, real *low, real *high)
+{
+  real *a = corner_position(triangle, 0);
+  real *b = corner_position(triangle, 1);
+  real *c = corner_position(triangle, 2);
+  for(int k = 0; k < 3; k++)
+  {
+    low[k] = std::min(a[k], std::min(b[k], c[k]));
+    high[k] = std::max(a[k], std::max(b[k], c[k]));
+  }
+}
+
+real box_area(real *low, real *high)
+{
+  real d[3] = {high[0] - low[0], high[1] - low[1], high[2] - low[2]};
+  return 2 * (d[0] * d[1] + d[1] * d[2] + d[2] * d[0]);
+}
+
+//grows the node's box to hold its children or its triangles
+void fit_bvh_node(BVHNode *node)
+{
+  for(int k = 0; k < 3; k++)
+  {
+    node->bounds_min[k] = std::numeric_limits<real>::max();
+    node->bounds_max[k] = -std::numeric_limits<real>::max();
+  }
+  if(node->count > 0)
+  {
+    for(int i = node->left; i < node->left + node->count; i++)
+    {
+      real low[3], high[3];
+      triangle_bounds(&triangles[bvh_order[i]], low, high);
+      for(int k = 0; k < 3; k++)
+      {
+        node->bounds_min[k] = std::min(node->bounds_min[k], low[k]);
+        node->bounds_max[k] = std::max(node->bounds_max[k], high[k]);
+      }
+    }
+    return;
+  }
+  for(int k = 0; k < 3; k++)
+  {
+    node->bounds_min[k] = std::min(bvh_nodes[node->left].bounds_min[k], bvh_nodes[node->right].bounds_min[k]);
+    node->bounds_max[k] = std::max(bvh_nodes[node->left].bounds_max[k], bvh_nodes[node->right].bounds_max[k]);
+  }
+}
+
+//expected cost of a ray through the tree under node, one per box visited and per
+//triangle tested, relative to entering its top box
+double bvh_sah_cost(int node, double rootArea)
+{
+  BVHNode *n = &bvh_nodes[node];
+  double area = box_area(n->bounds_min, n->bounds_max) / rootArea;
+  if(n->count > 0)
+    return area * n->count;
+  return area + bvh_sah_cost(n->left, rootArea) + bvh_sah_cost(n->right, rootArea);
+}
+
+//sah cost of the tree under root relative to its own box
+double bvh_tree_cost(int root)
+{
+  double area = box_area(bvh_nodes[root].bounds_min, bvh_nodes[root].bounds_max);
+  return area > 0 ? bvh_sah_cost(root, area) : 0;
+}
+
+//fits the boxes under node to the current vertex positions, children first,
+//keeping the tree's shape and the order of the triangles in its leaves. returns
+//the sah cost under node before it is divided by the area of the top box
+double refit_bvh(int node)
+{
+  BVHNode *n = &bvh_nodes[node];
+  double below = 0;
+  if(n->count == 0)
+    below = refit_bvh(n->left) + refit_bvh(n->right);
+  fit_bvh_node(n);
+  double area = box_area(n->bounds_min, n->bounds_max);
+  return n->count > 0 ? area * n->count : area + below;
+}
+
+//refits the scene's bvh and every mesh's at once. the top few levels are split
+//into subtrees the threads take turns to refit, then the nodes above them are
+//fit, parents after children. returns the most any tree's sah cost grew over its
+//cost when built
+double refit_bvhs()
+{
+  std::vector<int> queue, top, subtrees;
+  unsigned int head = 0;
+  
+  if(bvh_root >= 0)
+    queue.push_back(bvh_root);
+  for(unsigned int i = 0; i < meshes.size(); i++)
+    if(meshes[i].node >= 0)
+      queue.push_back(meshes[i].node);
+  //breadth first, so the biggest subtrees come first
+  while(head < queue.size() && (int)(queue.size() - head) < REFIT_SUBTREES * num_threads)
+  {
+    int node = queue[head++];
+    if(bvh_nodes[node].count > 0)
+      subtrees.push_back(node);
+    else
+    {
+      top.push_back(node);
+      queue.push_back(bvh_nodes[node].left);
+      queue.push_back(bvh_nodes[node].right);
+    }
+  }
+  subtrees.insert(subtrees.end(), queue.begin() + head, queue.end());
+  
+  std::vector<double> costs(subtrees.size());
+  std::atomic<int> next_subtree(0);
+  parallel_for(num_threads, [&](int, int)
+  {
+    for(int i; (i = next_subtree++) < (int)subtrees.size(); )
+      costs[i] = refit_bvh(subtrees[i]);
+  });
+  
+  //unnormalized costs of the nodes fit so far, the top ones are added in reverse
+  //breadth first order so both children are in before their parent
+  std::unordered_map<int, double> below;
+  for(unsigned int i = 0; i < subtrees.size(); i++)
+    below[subtrees[i]] = costs[i];
+  for(int i = (int)top.size() - 1; i >= 0; i--)
+  {
+    BVHNode *n = &bvh_nodes[top[i]];
+    fit_bvh_node(n);
+    below[top[i]] = box_area(n->bounds_min, n->bounds_max) + below[n->left] + below[n->right];
+  }
+  
+  double growth = 0;
+  for(int i = -1; i < (int)meshes.size(); i++)
+  {
+    int root = i < 0 ? bvh_root : meshes[i].node;
+    double built = i < 0 ? bvh_cost : meshes[i].cost;
+    if(root < 0 || built <= 0)
+      continue;
+    double area = box_area(bvh_nodes[root].bounds_min, bvh_nodes[root].bounds_max);
+    if(area > 0)
+      growth = std::max(growth, below[root] / area / built);
+  }
+  return growth;
+}
+
+//builds a bvh over the scene's own triangles and one over each mesh with the
+//selected builder, and reports what it cost
+void build_bvh()
+{
+  bvh_nodes.clear();
+  bvh_order.clear();
+  bvh_root = -1;
+  bvh_cost = 0;
+  for(unsigned int i = 0; i < meshes.size(); i++)
+  {
+    meshes[i].node = -1;
+    meshes[i].cost = 0;
+  }
+  if(bvh_builder == BVH_NONE || triangles.empty())
+    return;
+  
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  bvh_order.resize(triangles.size());
+  bvh_nodes.reserve(2 * triangles.size());
+  if(num_triangles > 0)
+    bvh_root = build_bvh_range(0, num_triangles);
+  for(unsigned int i = 0; i < meshes.size(); i++)
+    meshes[i].node = build_bvh_range(meshes[i].first, meshes[i].count);
+  for(unsigned int i = 0; i < meshes.size(); i++)
+    if(meshes[i].node >= 0)
+      meshes[i].cost = bvh_tree_cost(meshes[i].node);
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  printf("bvh: %s build of %d triangles, %d nodes, %.1f ms", bvh_builder == BVH_LBVH ? "lbvh" : "sah",
+         (int)triangles.size(), (int)bvh_nodes.size(), seconds * 1000);
+  if(bvh_root >= 0)
+  {
+    bvh_cost = bvh_tree_cost(bvh_root);
+    printf(", sah cost %.1f", bvh_cost);
+  }
+  printf("\n");
+}
+
+//bvh over triangles[first..first+count), returns its top node
+int build_bvh_range(int first, int count)
+{
+  if(count == 0)
+    return -1;
+  if(bvh_builder == BVH_LBVH)
+    return build_bvh_lbvh(first, count);
+  for(int i = first; i < first + count; i++)
+    bvh_order[i] = i;
+  return build_bvh_sah(first, first + count, 0);
+}
+
+//binned sah split of bvh_order[start..end) at depth in the tree, returns the node index
+int build_bvh_sah(int start, int end, int depth)
+{
+  int index = bvh_nodes.size();
+  bvh_nodes.push_back(BVHNode());
+  BVHNode node;
+  node.left = start;
+  node.right = -1;
+  node.count = end - start;
+  bvh_nodes[index] = node;
+  fit_bvh_node(&bvh_nodes[index]);
+  if(end - start <= 1 || depth >= BVH_MAX_DEPTH)
+    return index;
+  
+  //split along the axis the centroids spread furthest on
+  real centroidMin[3], centroidMax[3];
+  for(int k = 0; k < 3; k++)
+  {
+    centroidMin[k] = std::numeric_limits<real>::max();
+    centroidMax[k] = -std::numeric_limits<real>::max();
+  }
+  for(int i = start; i < end; i++)
+  {
+    Triangle *triangle = &triangles[bvh_order[i]];
+    for(int k = 0; k < 3; k++)
+    {
+      real centroid = triangle_centroid(triangle, k);
+      centroidMin[k] = std::min(centroidMin[k], centroid);
+      centroidMax[k] = std::max(centroidMax[k], centroid);
+    }
+  }
+  int axis = 0;
+  for(int k = 1; k < 3; k++)
+    if(centroidMax[k] - centroidMin[k] > centroidMax[axis] - centroidMin[axis])
+      axis = k;
+  real extent = centroidMax[axis] - centroidMin[axis];
+  //every centroid in one place, nothing to split on
+  if(extent <= 0)
+    return index;
+  
+  int mid;
+  if(depth < BVH_SAH_DEPTH)
+    mid = sah_split(index, start, end, axis, centroidMin[axis], extent);
+  else
+  {
+    mid = (start + end) / 2;
+    std::nth_element(&bvh_order[0] + start, &bvh_order[0] + mid, &bvh_order[0] + end, CentroidAxisLess(axis));
+  }
+  if(mid < 0)
+    return index;
+  int left = build_bvh_sah(start, mid, depth + 1);
+  int right = build_bvh_sah(mid, end, depth + 1);
+  bvh_nodes[index].left = left;
+  bvh_nodes[index].right = right;
+  bvh_nodes[index].count = 0;
+  return index;
+}
+
+//partitions bvh_order[start..end) at the cheapest of BVH_BINS splits of the centroids
+//along axis, returns where the right side starts or -1 if node is cheaper as a leaf
+int sah_split(int node, int start, int end, int axis, real centroidLow, real extent)
+{
+  int binCount[BVH_BINS] = {0};
+  real binMin[BVH_BINS][3], binMax[BVH_BINS][3];
+  for(int b = 0; b < BVH_BINS; b++)
+    for(int k = 0; k < 3; k++)
+    {
+      binMin[b][k] = std::numeric_limits<real>::max();
+      binMax[b][k] = -std::numeric_limits<real>::max();
+    }
+  for(int i = start; i < end; i++)
+  {
+    Triangle *triangle = &triangles[bvh_order[i]];
+    real low[3], high[3];
+    real centroid = triangle_centroid(triangle, axis);
+    int b = std::min(BVH_BINS - 1, (int)((centroid - centroidLow) / extent * BVH_BINS));
+    triangle_bounds(triangle, low, high);
+    binCount[b]++;
+    for(int k = 0; k < 3; k++)
+    {
+      binMin[b][k] = std::min(binMin[b][k], low[k]);
+      binMax[b][k] = std::max(binMax[b][k], high[k]);
+    }
+  }
+  
+  //sweep from the right keeping the area of everything past each split, then from the left
+  double rightArea[BVH_BINS];
+  int rightCount[BVH_BINS];
+  real low[3], high[3];
+  int count = 0;
+  for(int k = 0; k < 3; k++)
+  {
+    low[k] = std::numeric_limits<real>::max();
+    high[k] = -std::numeric_limits<real>::max();
+  }
+  for(int b = BVH_BINS - 1; b > 0; b--)
+  {
+    count += binCount[b];
+    for(int k = 0; k < 3; k++)
+    {
+      low[k] = std::min(low[k], binMin[b][k]);
+      high[k] = std::max(high[k], binMax[b][k]);
+    }
+    rightCount[b] = count;
+    rightArea[b] = count > 0 ? box_area(low, high) : 0;
+  }
+  int bestSplit = -1;
+  double bestCost = std::numeric_limits<double>::max();
+  count = 0;
+  for(int k = 0; k < 3; k++)
+  {
+    low[k] = std::numeric_limits<real>::max();
+    high[k] = -std::numeric_limits<real>::max();
+  }
+  for(int b = 1; b < BVH_BINS; b++)
+  {
+    count += binCount[b - 1];
+    for(int k = 0; k < 3; k++)
+    {
+      low[k] = std::min(low[k], binMin[b - 1][k]);
+      high[k] = std::max(high[k], binMax[b - 1][k]);
+    }
+    if(count == 0 || rightCount[b] == 0)
+      continue;
+    double cost = box_area(low, high) * count + rightArea[b] * rightCount[b];
+    if(cost < bestCost)
+    {
+      bestCost = cost;
+      bestSplit = b;
+    }
+  }
+  
+  //a split has to beat testing every triangle here, small nodes split whenever they can
+  double leafCost = box_area(bvh_nodes[node].bounds_min, bvh_nodes[node].bounds_max) * (end - start);
+  double splitCost = box_area(bvh_nodes[node].bounds_min, bvh_nodes[node].bounds_max) + bestCost;
+  if(bestSplit < 0 || (end - start <= BVH_LEAF_SIZE && splitCost >= leafCost))
+    return -1;
+  
+  int *middle = std::partition(&bvh_order[0] + start, &bvh_order[0] + end, CentroidBinLess(axis, centroidLow, extent, bestSplit));
+  return middle - &bvh_order[0];
+}
+
+//spreads the low 10 bits of v out to every third bit
+uint32_t spread_bits10(uint32_t v)
+{
+  v &= 0x3ff;
+  v = (v | (v << 16)) & 0x030000ff;
+  v = (v | (v << 8)) & 0x0300f00f;
+  v = (v | (v << 4)) & 0x030c30c3;
+  v = (v | (v << 2)) & 0x09249249;
+  return v;
+}
+
+//length of the common prefix of the sorted codes i and j, ties broken by
+//index so every code is distinct, -1 outside the array (Karras 2012)
+int lbvh_prefix(const std::vector<uint32_t> &codes, int i, int j)
+{
+  if(j < 0 || j >= (int)codes.size())
+    return -1;
+  if(codes[i] == codes[j])
+    return 32 + __builtin_clz((uint32_t)(i ^ j) | 1) - (i == j ? 1 : 0);
+  return __builtin_clz(codes[i] ^ codes[j]);
+}
+
+//linear bvh: triangles sorted along a morton curve of their centroids, then
+//every inner node found from the sorted codes on its own, so each step runs on
+//all threads (Karras 2012). leaves hold one triangle. built over
+//triangles[first..first+n), the n-1 inner nodes come first and then the n leaves,
+//returns the top node
+int build_bvh_lbvh(int first, int n)
+{
+  int base = bvh_nodes.size();
+  std::vector<uint32_t> codes(n), sortedCodes(n);
+  std::vector<int> order(n), scratch(n);
+  std::vector<int> parents(2 * n - 1, -1);
+  std::vector<std::atomic<int> > arrivals(n > 1 ? n - 1 : 1);
+  real centroidMin[3], centroidMax[3];
+  
+  bvh_nodes.resize(base + 2 * n - 1);
+  Triangle *range = &triangles[first];
+  for(int k = 0; k < 3; k++)
+  {
+    centroidMin[k] = std::numeric_limits<real>::max();
+    centroidMax[k] = -std::numeric_limits<real>::max();
+  }
+  for(int i = 0; i < n; i++)
+    for(int k = 0; k < 3; k++)
+    {
+      real centroid = triangle_centroid(&range[i], k);
+      centroidMin[k] = std::min(centroidMin[k], centroid);
+      centroidMax[k] = std::max(centroidMax[k], centroid);
+    }
+  
+  //30 bit morton code of every centroid
+  parallel_for(n, [&](int begin, int end)
+  {
+    for(int i = begin; i < end; i++)
+    {
+      uint32_t code = 0;
+      for(int k = 0; k < 3; k++)
+      {
+        real centroid = triangle_centroid(&range[i], k);
+        real extent = centroidMax[k] - centroidMin[k];
+        real t = extent > 0 ? (centroid - centroidMin[k]) / extent : 0;
+        code |= spread_bits10((uint32_t)std::min(std::max(t * 1024, (real)0), (real)1023)) << (2 - k);
+      }
+      codes[i] = code;
+      order[i] = i;
+    }
+  });
+  
+  //three passes of a 10 bit radix sort, each thread counts and then scatters its own slice
+  int slices = std::max(1, std::min(num_threads, n));
+  std::vector<unsigned int> counts(slices * 1024);
+  for(int shift = 0; shift < 30; shift += 10)
+  {
+    std::fill(counts.begin(), counts.end(), 0);
+    parallel_for(slices, [&](int first, int last)
+    {
+      for(int slice = first; slice < last; slice++)
+        for(int i = (long)n * slice / slices; i < (long)n * (slice + 1) / slices; i++)
+          counts[slice * 1024 + ((codes[order[i]] >> shift) & 1023)]++;
+    });
+    unsigned int offset = 0;
+    for(int digit = 0; digit < 1024; digit++)
+      for(int slice = 0; slice < slices; slice++)
+      {
+        unsigned int count = counts[slice * 1024 + digit];
+        counts[slice * 1024 + digit] = offset;
+        offset += count;
+      }
+    parallel_for(slices, [&](int first, int last)
+    {
+      for(int slice = first; slice < last; slice++)
+        for(int i = (long)n * slice / slices; i < (long)n * (slice + 1) / slices; i++)
+          scratch[counts[slice * 1024 + ((codes[order[i]] >> shift) & 1023)]++] = order[i];
+    });
+    order.swap(scratch);
+  }
+  for(int i = 0; i < n; i++)
+  {
+    sortedCodes[i] = codes[order[i]];
+    bvh_order[first + i] = first + order[i];
+  }
+  
+  //leaves
+  parallel_for(n, [&](int begin, int end)
+  {
+    for(int i = begin; i < end; i++)
+    {
+      BVHNode *leaf = &bvh_nodes[base + n - 1 + i];
+      leaf->left = first + i;
+      leaf->right = -1;
+      leaf->count = 1;
+      fit_bvh_node(leaf);
+    }
+  });
+  
+  //each inner node covers the range of codes sharing a prefix with its first
+  //key, and splits where that prefix grows
+  parallel_for(n - 1, [&](int begin, int end)
+  {
+    for(int i = begin; i < end; i++)
+    {
+      int direction = lbvh_prefix(sortedCodes, i, i + 1) > lbvh_prefix(sortedCodes, i, i - 1) ? 1 : -1;
+      int minPrefix = lbvh_prefix(sortedCodes, i, i - direction);
+      int maxLength = 2;
+      while(lbvh_prefix(sortedCodes, i, i + maxLength * direction) > minPrefix)
+        maxLength *= 2;
+      int length = 0;
+      for(int step = maxLength / 2; step >= 1; step /= 2)
+        if(lbvh_prefix(sortedCodes, i, i + (length + step) * direction) > minPrefix)
+          length += step;
+      int j = i + length * direction;
+      
+      int nodePrefix = lbvh_prefix(sortedCodes, i, j);
+      int split = 0;
+      int step = length;
+      do
+      {
+        step = (step + 1) / 2;
+        if(lbvh_prefix(sortedCodes, i, i + (split + step) * direction) > nodePrefix)
+          split += step;
+      } while(step > 1);
+      int gamma = i + split * direction + std::min(direction, 0);
+      
+      //parents are kept by index within this build
+      int left = std::min(i, j) == gamma ? n - 1 + gamma : gamma;
+      int right = std::max(i, j) == gamma + 1 ? n - 1 + gamma + 1 : gamma + 1;
+      BVHNode *node = &bvh_nodes[base + i];
+      node->left = base + left;
+      node->right = base + right;
+      node->count = 0;
+      parents[left] = i;
+      parents[right] = i;
+      arrivals[i] = 0;
+    }
+  });
+  
+  //boxes from the leaves up, the second child to arrive at a node fits it
+  parallel_for(n, [&](int begin, int end)
+  {
+    for(int i = begin; i < end; i++)
+    {
+      int node = parents[n - 1 + i];
+      while(node >= 0 && arrivals[node].fetch_add(1, std::memory_order_acq_rel) == 1)
+      {
+        fit_bvh_node(&bvh_nodes[base + node]);
+        node = parents[node];
+      }
+    }
+  });
+  return base;
+}
+
+//turns the binary bvh into the wide one rays traverse, every wide node taking
+//the four nodes left after opening its largest inner descendants
+void build_wide_bvh()
+{
+  wide_nodes.clear();
+  quantized8_nodes.clear();
+  quantized16_nodes.clear();
+  wide_root = -1;
+  for(unsigned int i = 0; i < meshes.size(); i++)
+    meshes[i].root = -1;
+  if(bvh_nodes.empty())
+    return;
+  wide_nodes.reserve(bvh_nodes.size() / 2 + 1);
+  if(bvh_root >= 0)
+    wide_root = collapse_bvh(bvh_root);
+  for(unsigned int i = 0; i < meshes.size(); i++)
+    if(meshes[i].node >= 0)
+      meshes[i].root = collapse_bvh(meshes[i].node);
+  
+  //swap the full nodes for quantized ones at the same indices
+  int count = wide_nodes.size();
+  int size = sizeof(WideNode);
+  if(bvh_node_bits == 8)
+  {
+    quantized8_nodes.resize(count);
+    for(int i = 0; i < count; i++)
+      quantize_node(&wide_nodes[i], &quantized8_nodes[i]);
+    size = sizeof(QuantizedNode8);
+  }
+  else if(bvh_node_bits == 16)
+  {
+    quantized16_nodes.resize(count);
+    for(int i = 0; i < count; i++)
+      quantize_node(&wide_nodes[i], &quantized16_nodes[i]);
+    size = sizeof(QuantizedNode16);
+  }
+  if(bvh_node_bits != 0)
+    SceneVector<WideNode>().swap(wide_nodes);
+  printf("bvh: collapsed to %d nodes of %d children, %d bytes each, %.2f MB (%.2f MB at full precision)\n",
+         count, BVH_WIDTH, size, (double)count * size / (1 << 20), (double)count * sizeof(WideNode) / (1 << 20));
+}
+
+//stores a wide node's child boxes as steps of the box around them. origin and
+//scale are floats rounded outwards, and each plane is moved out a step at a time
+//until, as traversal computes it, it holds the child's box with some slack to spare
+template <typename Q>
+void quantize_node(WideNode *wide, QuantizedNodeT<Q> *node)
+{
+  const real steps = std::numeric_limits<Q>::max();
+  
+  for(int k = 0; k < 3; k++)
+  {
+    real low = std::numeric_limits<real>::max();
+    real high = -std::numeric_limits<real>::max();
+    for(int i = 0; i < BVH_WIDTH; i++)
+      if(wide->count[i] >= 0)
+      {
+        low = std::min(low, wide->bounds[0][k][i]);
+        high = std::max(high, wide->bounds[1][k][i]);
+      }
+    
+    float origin = (float)low;
+    if(origin > low)
+      origin = std::nextafter(origin, -std::numeric_limits<float>::infinity());
+    real slack = 4 * std::numeric_limits<real>::epsilon() * (std::fabs(low) + std::fabs(high));
+    float scale = std::max((float)((high + slack - origin) / steps), std::numeric_limits<float>::min());
+    while((real)origin + steps * (real)scale < high + slack)
+      scale = std::nextafter(scale, std::numeric_limits<float>::infinity());
+    node->origin[k] = origin;
+    node->scale[k] = scale;
+    
+    for(int i = 0; i < BVH_WIDTH; i++)
+    {
+      //empty slots get a box inside out, it can't be entered
+      if(wide->count[i] < 0)
+      {
+        node->bounds[0][k][i] = (Q)steps;
+        node->bounds[1][k][i] = 0;
+        continue;
+      }
+      real q = std::floor((wide->bounds[0][k][i] - origin) / scale);
+      q = std::min(std::max(q, (real)0), steps);
+      while(q > 0 && (real)origin + q * (real)scale > wide->bounds[0][k][i] - slack)
+        q--;
+      node->bounds[0][k][i] = (Q)q;
+      q = std::ceil((wide->bounds[1][k][i] - origin) / scale);
+      q = std::min(std::max(q, (real)0), steps);
+      while(q < steps && (real)origin + q * (real)scale < wide->bounds[1][k][i] + slack)
+        q++;
+      node->bounds[1][k][i] = (Q)q;
+    }
+  }
+  for(int i = 0; i < BVH_WIDTH; i++)
+  {
+    node->child[i] = wide->child[i];
+    node->count[i] = wide->count[i];
+  }
+}
+
+//collapses the binary subtree under node into wide nodes, returns the index of the top one
+int collapse_bvh(int node)
+{
+  int slots[BVH_WIDTH];
+  int used = 0;
+  
+  //a root leaf becomes the one child of the root
+  if(bvh_nodes[node].count > 0)
+    slots[used++] = node;
+  else
+  {
+    slots[used++] = bvh_nodes[node].left;
+    slots[used++] = bvh_nodes[node].right;
+  }
+  while(used < BVH_WIDTH)
+  {
+    int largest = -1;
+    real largestArea = -1;
+    for(int i = 0; i < used; i++)
+    {
+      BVHNode *slot = &bvh_nodes[slots[i]];
+      real area = box_area(slot->bounds_min, slot->bounds_max);
+      if(slot->count == 0 && area > largestArea)
+      {
+        largest = i;
+        largestArea = area;
+      }
+    }
+    if(largest < 0)
+      break;
+    int opened = slots[largest];
+    slots[largest] = bvh_nodes[opened].left;
+    slots[used++] = bvh_nodes[opened].right;
+  }
+  
+  int index = wide_nodes.size();
+  wide_nodes.push_back(WideNode());
+  for(int i = 0; i < BVH_WIDTH; i++)
+  {
+    WideNode *wide = &wide_nodes[index];
+    if(i >= used)
+    {
+      for(int k = 0; k < 3; k++)
+      {
+        wide->bounds[0][k][i] = std::numeric_limits<real>::max();
+        wide->bounds[1][k][i] = -std::numeric_limits<real>::max();
+      }
+      wide->child[i] = 0;
+      wide->count[i] = -1;
+      continue;
+    }
+    BVHNode *slot = &bvh_nodes[slots[i]];
+    for(int k = 0; k < 3; k++)
+    {
+      wide->bounds[0][k][i] = slot->bounds_min[k];
+      wide->bounds[1][k][i] = slot->bounds_max[k];
+    }
+    wide->count[i] = slot->count;
+    wide->child[i] = slot->left;
+    //the vector may move while the child is collapsed
+    if(slot->count == 0)
+    {
+      int child = collapse_bvh(slots[i]);
+      wide_nodes[index].child[i] = child;
+    }
+  }
+  return index;
+}
+
+//orders instances along one axis while splitting the instance tree
+struct InstanceAxisLess
+{
+  int axis;
+  InstanceAxisLess(int a) : axis(a) {}
+  bool operator()(int a, int b) const
+  {
+    return instances[a].bounds_min[axis] + instances[a].bounds_max[axis] < instances[b].bounds_min[axis] + instances[b].bounds_max[axis];
+  }
+};
+
+//bounds every mesh and instance and builds the tree over the instance boxes
+void build_instances()
+{
+  long placed = 0;
+  
+  instance_nodes.clear();
+  instance_order.clear();
+  if(instances.empty())
+    return;
+  for(unsigned int m = 0; m < meshes.size(); m++)
+  {
+    Mesh *mesh = &meshes[m];
+    for(int k = 0; k < 3; k++)
+    {
+      mesh->bounds_min[k] = std::numeric_limits<real>::max();
+      mesh->bounds_max[k] = -std::numeric_limits<real>::max();
+    }
+    for(int i = mesh->first; i < mesh->first + mesh->count; i++)
+    {
+      real low[3], high[3];
+      triangle_bounds(&triangles[i], low, high);
+      for(int k = 0; k < 3; k++)
+      {
+        mesh->bounds_min[k] = std::min(mesh->bounds_min[k], low[k]);
+        mesh->bounds_max[k] = std::max(mesh->bounds_max[k], high[k]);
+      }
+    }
+  }
+  
+  //the scene box around the moved corners of the mesh box, padded for the rounding in the transform
+  for(unsigned int i = 0; i < instances.size(); i++)
+  {
+    Instance *instance = &instances[i];
+    Mesh *mesh = &meshes[instance->mesh];
+    for(int k = 0; k < 3; k++)
+    {
+      instance->bounds_min[k] = std::numeric_limits<real>::max();
+      instance->bounds_max[k] = -std::numeric_limits<real>::max();
+    }
+    for(int corner = 0; corner < 8; corner++)
+    {
+      real p[3] = {corner & 1 ? mesh->bounds_max[0] : mesh->bounds_min[0],
+                   corner & 2 ? mesh->bounds_max[1] : mesh->bounds_min[1],
+                   corner & 4 ? mesh->bounds_max[2] : mesh->bounds_min[2]};
+      for(int k = 0; k < 3; k++)
+      {
+        real q = instance->transform[k][0] * p[0] + instance->transform[k][1] * p[1] + instance->transform[k][2] * p[2] + instance->transform[k][3];
+        instance->bounds_min[k] = std::min(instance->bounds_min[k], q);
+        instance->bounds_max[k] = std::max(instance->bounds_max[k], q);
+      }
+    }
+    for(int k = 0; k < 3; k++)
+    {
+      real pad = 8 * std::numeric_limits<real>::epsilon() * (std::fabs(instance->bounds_min[k]) + std::fabs(instance->bounds_max[k]));
+      instance->bounds_min[k] -= pad;
+      instance->bounds_max[k] += pad;
+    }
+    instance_order.push_back(i);
+    placed += mesh->count;
+  }
+  instance_nodes.reserve(2 * instances.size());
+  build_instance_tree(0, instances.size());
+  printf("instancing: %d meshes of %d triangles placed %d times, standing in for %ld triangles\n",
+         (int)meshes.size(), (int)triangles.size() - num_triangles, (int)instances.size(), placed);
+}
+
+//median split of instance_order[start..end) like the light tree, returns the node index
+int build_instance_tree(int start, int end)
+{
+  int index = instance_nodes.size();
+  instance_nodes.push_back(BVHNode());
+  BVHNode node;
+  int axis = 0;
+  
+  for(int k = 0; k < 3; k++)
+  {
+    node.bounds_min[k] = std::numeric_limits<real>::max();
+    node.bounds_max[k] = -std::numeric_limits<real>::max();
+  }
+  for(int i = start; i < end; i++)
+    for(int k = 0; k < 3; k++)
+    {
+      node.bounds_min[k] = std::min(node.bounds_min[k], instances[instance_order[i]].bounds_min[k]);
+      node.bounds_max[k] = std::max(node.bounds_max[k], instances[instance_order[i]].bounds_max[k]);
+    }
+  node.left = start;
+  node.right = -1;
+  node.count = end - start;
+  instance_nodes[index] = node;
+  if(end - start == 1)
+    return index;
+  
+  for(int k = 1; k < 3; k++)
+    if(node.bounds_max[k] - node.bounds_min[k] > node.bounds_max[axis] - node.bounds_min[axis])
+      axis = k;
+  int mid = (start + end) / 2;
+  std::nth_element(&instance_order[0] + start, &instance_order[0] + mid, &instance_order[0] + end, InstanceAxisLess(axis));
+  int left = build_instance_tree(start, mid);
+  int right = build_instance_tree(mid, end);
+  instance_nodes[index].left = left;
+  instance_nodes[index].right = right;
+  instance_nodes[index].count = 0;
+  return index;
+}
+
+//bounds of everything in the scene, for quantizing ray origins
+void find_scene_bounds()
+{
+  for(int k = 0; k < 3; k++)
+  {
+    scene_min[k] = 1e30;
+    scene_max[k] = -1e30;
+  }
+  for(int i = 0; i < num_triangles; i++)
+    for(int j = 0; j < 3; j++)
+      for(int k = 0; k < 3; k++)
+      {
+        scene_min[k] = std::min(scene_min[k], corner_position(&triangles[i], j)[k]);
+        scene_max[k] = std::max(scene_max[k], corner_position(&triangles[i], j)[k]);
+      }
+  for(unsigned int i = 0; i < instances.size(); i++)
+    for(int k = 0; k < 3; k++)
+    {
+      scene_min[k] = std::min(scene_min[k], instances[i].bounds_min[k]);
+      scene_max[k] = std::max(scene_max[k], instances[i].bounds_max[k]);
+    }
+  for(int i = 0; i < num_spheres; i++)
+    for(int k = 0; k < 3; k++)
+    {
+      scene_min[k] = std::min(scene_min[k], spheres[i].position[k] - spheres[i].radius);
+      scene_max[k] = std::max(scene_max[k], spheres[i].position[k] + spheres[i].radius);
+    }
+}
+
+//spreads the low 9 bits of v out to every third bit
+uint32_t spread_bits(uint32_t v)
+{
+  v &= 0x1ff;
+  v = (v | (v << 16)) & 0x030000ff;
+  v = (v | (v << 8)) & 0x0300f00f;
+  v = (v | (v << 4)) & 0x030c30c3;
+  v = (v | (v << 2)) & 0x09249249;
+  return v;
+}
+
+//direction octant in the top bits, then the morton code of the origin on a 512^3 grid
+uint32_t ray_sort_key(Ray *ray)
+{
+  uint32_t key = (ray->direction[0] < 0) | ((ray->direction[1] < 0) << 1) | ((ray->direction[2] < 0) << 2);
+  uint32_t morton = 0;
+  for(int k = 0; k < 3; k++)
+  {
+    real extent = scene_max[k] - scene_min[k];
+    real t = extent > 0 ? (ray->position[k] - scene_min[k]) / extent : 0;
+    uint32_t cell = (uint32_t)std::min(std::max(t * 512, (real)0), (real)511);
+    morton |= spread_bits(cell) << k;
+  }
+  return (key << 27) | morton;
+}
+
+//orders keys by octant and origin, counting how often neighbours share an
+//octant and one of the 512 coarse origin cells before and after
+void sort_ray_keys(std::vector<RayKey> &keys)
+{
+  long before = 0, after = 0;
+  
+  for(unsigned int i = 1; i < keys.size(); i++)
+    before += (keys[i].key >> 18) == (keys[i - 1].key >> 18);
+  //the keys are 30 bits, three passes of a 10 bit radix sort
+  static thread_local std::vector<RayKey> scratch;
+  scratch.resize(keys.size());
+  for(int shift = 0; shift < 30; shift += 10)
+  {
+    unsigned int counts[1025] = {0};
+    for(unsigned int i = 0; i < keys.size(); i++)
+      counts[((keys[i].key >> shift) & 1023) + 1]++;
+    for(int b = 0; b < 1024; b++)
+      counts[b + 1] += counts[b];
+    for(unsigned int i = 0; i < keys.size(); i++)
+      scratch[counts[(keys[i].key >> shift) & 1023]++] = keys[i];
+    keys.swap(scratch);
+  }
+  for(unsigned int i = 1; i < keys.size(); i++)
+    after += (keys[i].key >> 18) == (keys[i - 1].key >> 18);
+  if(keys.size() > 1)
+  {
+    sorted_ray_pairs += keys.size() - 1;
+    coherent_pairs_before += before;
+    coherent_pairs_after += after;
+  }
+}
+
+//adds one sample per active pixel of a finished row to the accumulation
+void commit_row(int y, double (*row_radiance)[3])
+{
+  std::lock_guard<std::mutex> lock(checkpoint_lock);
+  for(int x = crop_left; x < crop_right; x++)
+  {
+    if(!pixel_active[y][x])
+      continue;
+    double *radiance = row_radiance[x];
+    float luminance = 0.2126f * radiance[0] + 0.7152f * radiance[1] + 0.0722f * radiance[2];
+    accumulation[y][x][0] += radiance[0];
+    accumulation[y][x][1] += radiance[1];
+    accumulation[y][x][2] += radiance[2];
+    accumulation_sq[y][x] += luminance * luminance;
+    sample_counts[y][x]++;
+  }
+  row_passes[y]++;
+  maybe_checkpoint();
+}
+
+//path tracing a batch of rows a bounce at a time instead of a path at a time.
+//every path's next ray goes in one queue that is intersected in one loop, its
+//shadow rays in another, so each stage runs the same code over many rays.
+//random numbers are drawn in the same order per path as trace_path, so the
+//image is the same either way
+void render_rows_wavefront()
+{
+  static thread_local std::vector<PathState> paths;
+  static thread_local std::vector<int> queue, next;
+  static thread_local std::vector<ShadowRay> shadows;
+  static thread_local std::vector<RayKey> keys;
+  static thread_local std::vector<char> blocked;
+  static thread_local double batch_radiance[WAVEFRONT_ROWS][WIDTH][3];
+  bool sampled = light_samples > 0 && num_lights > light_samples;
+  int first;
+  
+  while((first = next_row.fetch_add(WAVEFRONT_ROWS)) < crop_bottom - crop_top)
+  {
+    int rows = std::min(WAVEFRONT_ROWS, crop_bottom - crop_top - first);
+    if(out_of_time())
+      break;
+    
+    //primary rays for every pixel this pass shades
+    paths.clear();
+    queue.clear();
+    for(int row = first; row < first + rows; row++)
+    {
+      int y = HEIGHT - crop_bottom + row;
+      if(row_passes[y] > passes_done)
+        continue;
+      for(int x = crop_left; x < crop_right; x++)
+      {
+        if(!pixel_active[y][x])
+          continue;
+        PathState path;
+        path.x = x;
+        path.y = row - first;
+        path.seed = pixel_seed(x, y, sample_counts[y][x]);
+        double sampleX = x;
+        double sampleY = y;
+        if(samples_per_pixel > 1)
+        {
+          sampleX += random_double(&path.seed) - 0.5;
+          sampleY += random_double(&path.seed) - 0.5;
+        }
+        path.ray = cast_ray(sampleX, sampleY);
+        for(int c = 0; c < 3; c++)
+        {
+          path.throughput[c] = 1;
+          path.radiance[c] = 0;
+        }
+        queue.push_back(paths.size());
+        paths.push_back(path);
+      }
+    }
+    
+    for(int depth = 0; depth < max_depth && !queue.empty(); depth++)
+    {
+      //primary rays are already in scanline order, bounces are scattered
+      if(sort_rays && depth > 0)
+      {
+        keys.resize(queue.size());
+        for(unsigned int i = 0; i < queue.size(); i++)
+        {
+          keys[i].key = ray_sort_key(&paths[queue[i]].ray);
+          keys[i].index = queue[i];
+        }
+        sort_ray_keys(keys);
+        for(unsigned int i = 0; i < queue.size(); i++)
+          queue[i] = keys[i].index;
+      }
+      
+      //intersect the whole queue, paths that escape are finished
+      next.clear();
+      for(unsigned int i = 0; i < queue.size(); i++)
+      {
+        PathState *path = &paths[queue[i]];
+        rays_traced++;
+        if(closest_hit(path->ray, &path->hit))
+          next.push_back(queue[i]);
+      }
+      queue.swap(next);
+      
+      //shade the hits: queue shadow rays, then roulette and pick the bounce
+      shadows.clear();
+      for(unsigned int i = 0; i < queue.size(); i++)
+      {
+        PathState *path = &paths[queue[i]];
+        real normal[3];
+        double albedo[3];
+        
+        hit_surface(path->ray, path->hit, normal, albedo);
+        //one shadow ray per light, or per light tree sample, as nextEventEstimate does
+        for(int j = 0; j < (sampled ? light_samples : num_lights); j++)
+        {
+          ShadowRay shadow;
+          shadow.light = j;
+          shadow.pdf = 1;
+          if(sampled)
+          {
+            shadow.light = sample_light_tree(path->hit.position, normal, random_double(&path->seed), &shadow.pdf);
+            if(shadow.light < 0)
+              continue;
+          }
+          shadow.ray = shadow_ray(path->hit, normal, shadow.light, &shadow.distance);
+          shadow.contribution = (normal[0] * shadow.ray.direction[0]) + (normal[1] * shadow.ray.direction[1]) + (normal[2] * shadow.ray.direction[2]);
+          shadow.path = queue[i];
+          shadows.push_back(shadow);
+        }
+        
+        for(int c = 0; c < 3; c++)
+        {
+          path->weight[c] = path->throughput[c] * albedo[c];
+          path->direct[c] = 0;
+          path->throughput[c] *= albedo[c];
+        }
+        path->bounces = true;
+        if(depth >= 2)
+        {
+          double survive = std::min(0.95, std::max(path->throughput[0], std::max(path->throughput[1], path->throughput[2])));
+          if(random_double(&path->seed) >= survive)
+          {
+            path->bounces = false;
+            continue;
+          }
+          for(int c = 0; c < 3; c++)
+            path->throughput[c] /= survive;
+        }
+        cosine_bounce(path->hit, normal, &path->seed, &path->ray);
+      }
+      
+      //trace every shadow ray of the bounce, in sorted order if asked
+      keys.resize(shadows.size());
+      for(unsigned int i = 0; i < shadows.size(); i++)
+      {
+        keys[i].key = sort_rays ? ray_sort_key(&shadows[i].ray) : 0;
+        keys[i].index = i;
+      }
+      if(sort_rays)
+        sort_ray_keys(keys);
+      blocked.resize(shadows.size());
+      for(unsigned int i = 0; i < keys.size(); i++)
+      {
+        ShadowRay *shadow = &shadows[keys[i].index];
+        rays_traced++;
+        blocked[keys[i].index] = inShadow(shadow->ray, shadow->distance, shadow->light);
+      }
+      
+      //light is added in queue order so the sums don't depend on the sorting
+      for(unsigned int i = 0; i < shadows.size(); i++)
+      {
+        ShadowRay *shadow = &shadows[i];
+        if(blocked[i] || shadow->contribution <= 0)
+          continue;
+        for(int c = 0; c < 3; c++)
+          paths[shadow->path].direct[c] += sampled ? lights[shadow->light].color[c] * shadow->contribution / shadow->pdf
+                                                   : lights[shadow->light].color[c] * shadow->contribution;
+      }
+      
+      //add the direct light and keep the paths that bounce on
+      next.clear();
+      for(unsigned int i = 0; i < queue.size(); i++)
+      {
+        PathState *path = &paths[queue[i]];
+        for(int c = 0; c < 3; c++)
+        {
+          if(sampled)
+            path->direct[c] /= light_samples;
+          path->radiance[c] += path->weight[c] * path->direct[c];
+        }
+        if(path->bounces)
+          next.push_back(queue[i]);
+      }
+      queue.swap(next);
+    }
+    
+    for(unsigned int i = 0; i < paths.size(); i++)
+      for(int c = 0; c < 3; c++)
+        batch_radiance[paths[i].y][paths[i].x][c] = paths[i].radiance[c];
+    for(int row = first; row < first + rows; row++)
+    {
+      int y = HEIGHT - crop_bottom + row;
+      if(row_passes[y] <= passes_done)
+        commit_row(y, batch_radiance[row - first]);
+    }
+  }
+  flush_thread_stats();
+}
+
+//saves the progress if the interval has passed, call with checkpoint_lock held
+void maybe_checkpoint()
+{
+  if(checkpoint_file && std::chrono::duration<double>(std::chrono::steady_clock::now() - last_checkpoint).count() >= checkpoint_interval)
+  {
+    write_checkpoint();
+    last_checkpoint = std::chrono::steady_clock::now();
+  }
+}
+
+//read or write all of a message, false if the other end has gone away or,
+//given a timeout, has sent nothing for that many seconds
+bool read_fully(int fd, void *data, size_t size, double timeout = -1)
+{
+  char *bytes = (char *)data;
+  while(size > 0)
+  {
+    if(timeout >= 0)
+    {
+      pollfd waiting = {fd, POLLIN, 0};
+      int ready = poll(&waiting, 1, (int)(timeout * 1000));
+      if(ready < 0 && errno == EINTR)
+        continue;
+      if(ready <= 0)
+        return false;
+    }
+    ssize_t got = read(fd, bytes, size);
+    if(got < 0 && errno == EINTR)
+      continue;
+    if(got <= 0)
+      return false;
+    bytes += got;
+    size -= got;
+  }
+  return true;
+}
+
+bool write_fully(int fd, const void *data, size_t size)
+{
+  const char *bytes = (const char *)data;
+  while(size > 0)
+  {
+    ssize_t sent = write(fd, bytes, size);
+    if(sent < 0 && errno == EINTR)
+      continue;
+    if(sent <= 0)
+      return false;
+    bytes += sent;
+    size -= sent;
+  }
+  return true;
+}
+
+//closes every descriptor the worker was forked with but stdio and its socket:
+//the other workers' sockets, the scene watch and, for workers forked again after
+//a reload, glut's display connection
+void close_inherited_fds(int keep)
+{
+  std::vector<int> inherited;
+  DIR *dir = opendir("/dev/fd");
+  
+  if(dir != NULL)
+  {
+    //collected first, closing them would change the listing being read
+    for(dirent *entry = readdir(dir); entry != NULL; entry = readdir(dir))
+      if(entry->d_name[0] != '.')
+        inherited.push_back(atoi(entry->d_name));
+    closedir(dir);
+  }
+  else
+  {
+    long limit = sysconf(_SC_OPEN_MAX);
+    for(int fd = 0; fd < limit; fd++)
+      inherited.push_back(fd);
+  }
+  for(unsigned int i = 0; i < inherited.size(); i++)
+    if(inherited[i] > STDERR_FILENO && inherited[i] != keep)
+      close(inherited[i]);
+}
+
+//forks the worker processes once the scene is loaded, so each has its own copy
+void start_workers()
+{
+  //a dead worker shows up as a failed write instead of killing the master
+  signal(SIGPIPE, SIG_IGN);
+  fflush(stdout);
+  for(int i = 0; i < num_workers; i++)
+  {
+    int fds[2];
+    Worker worker;
+    
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+    {
+      perror("socketpair");
+      break;
+    }
+    worker.pid = fork();
+    if(worker.pid < 0)
+    {
+      perror("fork");
+      close(fds[0]);
+      close(fds[1]);
+      break;
+    }
+    if(worker.pid == 0)
+    {
+      close_inherited_fds(fds[1]);
+      worker_loop(fds[1]);
+    }
+    close(fds[1]);
+    worker.fd = fds[0];
+    worker.tile = -1;
+    worker_processes.push_back(worker);
+  }
+  num_workers = worker_processes.size();
+  printf("%d worker processes with %d threads each\n", num_workers, num_threads);
+}
+
+//hanging up tells the workers to exit, one still there after WORKER_TIMEOUT
+//seconds has hung and is killed
+void stop_workers()
+{
+  std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::seconds(WORKER_TIMEOUT);
+  
+  for(unsigned int i = 0; i < worker_processes.size(); i++)
+    if(worker_processes[i].fd >= 0)
+      close(worker_processes[i].fd);
+  for(unsigned int i = 0; i < worker_processes.size(); i++)
+  {
+    if(worker_processes[i].fd < 0)
+      continue;
+    while(waitpid(worker_processes[i].pid, NULL, WNOHANG) == 0)
+    {
+      if(std::chrono::steady_clock::now() < deadline)
+      {
+        usleep(10000);
+        continue;
+      }
+      printf("worker %d didn't exit, killing it\n", (int)worker_processes[i].pid);
+      kill(worker_processes[i].pid, SIGKILL);
+      waitpid(worker_processes[i].pid, NULL, 0);
+      break;
+    }
+    worker_processes[i].fd = -1;
+  }
+}
+
+void worker_failed(Worker *worker)
+{
+  printf("worker %d stopped responding, its tile goes back in the queue\n", (int)worker->pid);
+  close(worker->fd);
+  kill(worker->pid, SIGKILL);
+  waitpid(worker->pid, NULL, 0);
+  worker->fd = -1;
+  worker->tile = -1;
+  num_workers--;
+}
+
+//sends the sample index of every pixel the tile should shade this pass
+bool send_tile(Worker *worker, int first_row)
+{
+  static unsigned int indices[TILE_ROWS * WIDTH];
+  TileRequest request;
+  
+  request.pass = passes_done;
+  request.first_row = first_row;
+  request.rows = std::min(TILE_ROWS, crop_bottom - first_row);
+  for(int row = 0; row < request.rows; row++)
+  {
+    int y = HEIGHT - 1 - (first_row + row);
+    for(int x = 0; x < WIDTH; x++)
+    {
+      bool shade = x >= crop_left && x < crop_right && pixel_active[y][x] && row_passes[y] <= passes_done;
+      indices[row * WIDTH + x] = shade ? sample_counts[y][x] : UINT_MAX;
+    }
+  }
+  return write_fully(worker->fd, &request, sizeof(request)) &&
+         write_fully(worker->fd, indices, sizeof(unsigned int) * request.rows * WIDTH);
+}
+
+//seconds a worker may hold a tile before it counts as hung
+double tile_deadline()
+{
+  if(worker_timeout > 0)
+    return worker_timeout;
+  double mean = tiles_returned > 0 ? tile_seconds / tiles_returned : 0;
+  return std::max((double)WORKER_TIMEOUT, WORKER_TIMEOUT_TILES * mean);
+}
+
+//adds a finished tile to the accumulation
+bool receive_tile(Worker *worker)
+{
+  static float samples[TILE_ROWS * WIDTH * 4];
+  TileReply reply;
+  
+  //a worker that stops partway through its reply counts as hung too
+  double timeout = tile_deadline();
+  if(!read_fully(worker->fd, &reply, sizeof(reply), timeout) || reply.first_row != worker->tile || reply.rows < 0 || reply.rows > TILE_ROWS ||
+     reply.first_row + reply.rows > crop_bottom || !read_fully(worker->fd, samples, sizeof(float) * 4 * reply.rows * WIDTH, timeout))
+    return false;
+  
+  std::lock_guard<std::mutex> lock(checkpoint_lock);
+  for(int row = 0; row < reply.rows; row++)
+  {
+    int y = HEIGHT - 1 - (reply.first_row + row);
+    if(row_passes[y] > passes_done)
+      continue;
+    for(int x = crop_left; x < crop_right; x++)
+    {
+      float *sample = &samples[4 * (row * WIDTH + x)];
+      if(!pixel_active[y][x])
+        continue;
+      accumulation[y][x][0] += sample[0];
+      accumulation[y][x][1] += sample[1];
+      accumulation[y][x][2] += sample[2];
+      accumulation_sq[y][x] += sample[3];
+      sample_counts[y][x]++;
+    }
+    row_passes[y]++;
+  }
+  total_rays_traced += reply.rays;
+  shadow_cache_lookups += reply.shadow_lookups;
+  shadow_cache_hits += reply.shadow_hits;
+  maybe_checkpoint();
+  return true;
+}
+
+//hands the pass out to the workers a tile at a time, giving the tile of a
+//worker that dies or hangs to another one
+void distribute_pass()
+{
+  std::vector<int> tiles;
+  std::vector<struct pollfd> waiting;
+  int outstanding = 0;
+  
+  //tiles are taken from the back, so the top of the image comes first
+  for(int first_row = crop_top + ((crop_bottom - crop_top - 1) / TILE_ROWS) * TILE_ROWS; first_row >= crop_top; first_row -= TILE_ROWS)
+    tiles.push_back(first_row);
+  
+  while(true)
+  {
+    for(unsigned int i = 0; i < worker_processes.size() && !tiles.empty() && !out_of_time(); i++)
+    {
+      Worker *worker = &worker_processes[i];
+      if(worker->fd < 0 || worker->tile >= 0)
+        continue;
+      if(send_tile(worker, tiles.back()))
+      {
+        worker->tile = tiles.back();
+        worker->sent = std::chrono::steady_clock::now();
+        tiles.pop_back();
+        outstanding++;
+      }
+      else
+        worker_failed(worker);
+    }
+    if(outstanding == 0)
+      break;
+    
+    //wait until a tile comes back or the oldest one runs out of time
+    double limit = tile_deadline();
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    int timeout = -1;
+    waiting.clear();
+    for(unsigned int i = 0; i < worker_processes.size(); i++)
+      if(worker_processes[i].fd >= 0 && worker_processes[i].tile >= 0)
+      {
+        struct pollfd entry = {worker_processes[i].fd, POLLIN, 0};
+        double left = limit - std::chrono::duration<double>(now - worker_processes[i].sent).count();
+        int milliseconds = std::max(0, (int)std::ceil(left * 1000));
+        timeout = timeout < 0 ? milliseconds : std::min(timeout, milliseconds);
+        waiting.push_back(entry);
+      }
+    if(poll(&waiting[0], waiting.size(), timeout) < 0 && errno != EINTR)
+    {
+      perror("poll");
+      break;
+    }
+    now = std::chrono::steady_clock::now();
+    for(unsigned int i = 0; i < worker_processes.size(); i++)
+    {
+      Worker *worker = &worker_processes[i];
+      unsigned int j;
+      for(j = 0; j < waiting.size() && waiting[j].fd != worker->fd; j++);
+      if(worker->fd < 0 || worker->tile < 0 || j == waiting.size())
+        continue;
+      double held = std::chrono::duration<double>(now - worker->sent).count();
+      if(waiting[j].revents == 0)
+      {
+        if(held < limit)
+          continue;
+        printf("worker %d has held its tile for %.1f s\n", (int)worker->pid, held);
+        outstanding--;
+        tiles.push_back(worker->tile);
+        worker_failed(worker);
+        continue;
+      }
+      outstanding--;
+      if(receive_tile(worker))
+      {
+        tile_seconds += held;
+        tiles_returned++;
+        worker->tile = -1;
+      }
+      else
+      {
+        tiles.push_back(worker->tile);
+        worker_failed(worker);
+      }
+    }
+  }
+  
+  //rows no worker finished are rendered here, done rows are skipped
+  if(num_workers == 0 && !tiles.empty() && !out_of_time())
+  {
+    printf("no worker processes left, rendering the rest of the pass here\n");
+    render_pass();
+  }
+}
+
+//serves tiles for the master until it hangs up. each tile is rendered as a
+//crop of this process's own buffers, starting from zero
+void worker_loop(int fd)
+{
+  static unsigned int indices[TILE_ROWS * WIDTH];
+  static float samples[TILE_ROWS * WIDTH * 4];
+  TileRequest request;
+  TileReply reply;
+  
+  checkpoint_file = 0;
+  time_budget = 0;
+  while(read_fully(fd, &request, sizeof(request)) && request.rows > 0 && request.rows <= TILE_ROWS &&
+        read_fully(fd, indices, sizeof(unsigned int) * request.rows * WIDTH))
+  {
+    long rays = total_rays_traced, lookups = shadow_cache_lookups, hits = shadow_cache_hits;
+    
+    crop_top = request.first_row;
+    crop_bottom = request.first_row + request.rows;
+    passes_done = request.pass;
+    for(int row = 0; row < request.rows; row++)
+    {
+      int y = HEIGHT - 1 - (request.first_row + row);
+      for(int x = 0; x < WIDTH; x++)
+      {
+        unsigned int index = indices[row * WIDTH + x];
+        pixel_active[y][x] = index != UINT_MAX;
+        sample_counts[y][x] = pixel_active[y][x] ? index : 0;
+      }
+      memset(accumulation[y], 0, sizeof(accumulation[y]));
+      memset(accumulation_sq[y], 0, sizeof(accumulation_sq[y]));
+      row_passes[y] = request.pass;
+    }
+    render_pass();
+    
+    for(int row = 0; row < request.rows; row++)
+    {
+      int y = HEIGHT - 1 - (request.first_row + row);
+      for(int x = 0; x < WIDTH; x++)
+      {
+        float *sample = &samples[4 * (row * WIDTH + x)];
+        sample[0] = accumulation[y][x][0];
+        sample[1] = accumulation[y][x][1];
+        sample[2] = accumulation[y][x][2];
+        sample[3] = accumulation_sq[y][x];
+      }
+    }
+    reply.first_row = request.first_row;
+    reply.rows = request.rows;
+    reply.rays = total_rays_traced - rays;
+    reply.shadow_lookups = shadow_cache_lookups - lookups;
+    reply.shadow_hits = shadow_cache_hits - hits;
+    if(!write_fully(fd, &reply, sizeof(reply)) || !write_fully(fd, samples, sizeof(float) * 4 * request.rows * WIDTH))
+      break;
+  }
+  _exit(0);
+}
+
+bool out_of_time()
+{
+  return time_budget > 0 && std::chrono::steady_clock::now() >= deadline;
+}
+
+//orders pixels noisiest first while choosing the next adaptive pass
+struct PixelErrorGreater
+{
+  bool operator()(int a, int b) const { return pixel_error[a] > pixel_error[b]; }
+};
+
+//marks the noisier half of the image for the next pass. the error is the drop in
+//squared relative error one more sample is expected to give, with a small prior
+//so pixels whose first samples happened to agree are still revisited
+void select_noisy_pixels()
+{
+  static int order[HEIGHT * WIDTH];
+  int count = 0;
+  
+  for(int y = HEIGHT - crop_bottom; y < HEIGHT - crop_top; y++)
+    for(int x = crop_left; x < crop_right; x++)
+    {
+      unsigned int n = sample_counts[y][x];
+      float *sums = accumulation[y][x];
+      float mean = (0.2126f * sums[0] + 0.7152f * sums[1] + 0.0722f * sums[2]) / std::max(n, 1u);
+      float variance = n > 1 ? std::max(accumulation_sq[y][x] / n - mean * mean, 0.0f) * n / (n - 1) : 0.0f;
+      pixel_error[y * WIDTH + x] = n > 1 ? (variance / (mean * mean + 0.01f) + 0.1f) / (n * (n + 1.0f)) : FLT_MAX;
+      order[count++] = y * WIDTH + x;
+    }
+  
+  std::nth_element(order, order + count / 2, order + count, PixelErrorGreater());
+  memset(pixel_active, 0, sizeof(pixel_active));
+  for(int i = 0; i < count / 2; i++)
+    pixel_active[order[i] / WIDTH][order[i] % WIDTH] = 1;
+}
+
+//saves the accumulation, sample counts and row progress, call with checkpoint_lock held.
+//the file is written beside the old one and renamed over it so a kill never leaves it half written
+int write_checkpoint()
+{
+  char temp[1024];
+  CheckpointHeader header;
+  FILE *file;
+  int ok;
+  
+  snprintf(temp, sizeof(temp), "%s.tmp", checkpoint_file);
+  file = fopen(temp, "wb");
+  if(!file)
+  {
+    printf("can't write checkpoint %s\n", temp);
+    return 0;
+  }
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, "RTCKPT4", 8);
+  header.width = WIDTH;
+  header.height = HEIGHT;
+  header.render_mode = render_mode;
+  header.passes_done = passes_done;
+  header.crop[0] = crop_left;
+  header.crop[1] = crop_top;
+  header.crop[2] = crop_right;
+  header.crop[3] = crop_bottom;
+  header.scene_hash = scene_file_hash;
+  header.max_depth = max_depth;
+  header.light_samples = light_samples;
+  ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+       fwrite(row_passes, sizeof(row_passes), 1, file) == 1 &&
+       fwrite(sample_counts, sizeof(sample_counts), 1, file) == 1 &&
+       fwrite(accumulation, sizeof(accumulation), 1, file) == 1 &&
+       fwrite(accumulation_sq, sizeof(accumulation_sq), 1, file) == 1;
+  ok = fclose(file) == 0 && ok;
+  if(!ok || rename(temp, checkpoint_file) != 0)
+  {
+    printf("error writing checkpoint %s\n", checkpoint_file);
+    remove(temp);
+    return 0;
+  }
+  return 1;
+}
+
+//restores a checkpoint written from the same scene file with the same mode, image
+//size and sampling settings, returns 0 to start fresh
+int read_checkpoint()
+{
+  CheckpointHeader header;
+  FILE *file = fopen(checkpoint_file, "rb");
+  int ok;
+  
+  if(!file)
+  {
+    printf("no checkpoint %s, starting from the beginning\n", checkpoint_file);
+    return 0;
+  }
+  ok = fread(&header, sizeof(header), 1, file) == 1;
+  if(!ok || memcmp(header.magic, "RTCKPT4", 8) != 0 || header.width != WIDTH || header.height != HEIGHT)
+  {
+    printf("%s is not a checkpoint of a %dx%d render\n", checkpoint_file, WIDTH, HEIGHT);
+    fclose(file);
+    return 0;
+  }
+  if(header.crop[0] != crop_left || header.crop[1] != crop_top || header.crop[2] != crop_right || header.crop[3] != crop_bottom)
+  {
+    printf("%s was rendered with -crop %d %d %d %d\n", checkpoint_file, header.crop[0], header.crop[1], header.crop[2], header.crop[3]);
+    fclose(file);
+    return 0;
+  }
+  if(header.render_mode != render_mode)
+  {
+    printf("%s was rendered with the other integrator, %s\n", checkpoint_file, render_mode == RENDER_PATH ? "leave out -path" : "add -path");
+    fclose(file);
+    return 0;
+  }
+  if(header.scene_hash != scene_file_hash)
+  {
+    printf("%s was rendered from a different %s, starting from the beginning\n", checkpoint_file, scene_file);
+    fclose(file);
+    return 0;
+  }
+  if(header.max_depth != max_depth || header.light_samples != light_samples)
+  {
+    printf("%s was rendered with -depth %d -lightsamples %d\n", checkpoint_file, header.max_depth, header.light_samples);
+    fclose(file);
+    return 0;
+  }
+  ok = fread(row_passes, sizeof(row_passes), 1, file) == 1 &&
+       fread(sample_counts, sizeof(sample_counts), 1, file) == 1 &&
+       fread(accumulation, sizeof(accumulation), 1, file) == 1 &&
+       fread(accumulation_sq, sizeof(accumulation_sq), 1, file) == 1;
+  fclose(file);
+  if(!ok)
+  {
+    printf("checkpoint %s is truncated, starting from the beginning\n", checkpoint_file);
+    memset(row_passes, 0, sizeof(row_passes));
+    memset(sample_counts, 0, sizeof(sample_counts));
+    memset(accumulation, 0, sizeof(accumulation));
+    memset(accumulation_sq, 0, sizeof(accumulation_sq));
+    return 0;
+  }
+  
+  //carry on with the pass the slowest row was in
+  passes_done = *std::min_element(row_passes + HEIGHT - crop_bottom, row_passes + HEIGHT - crop_top);
+  printf("resuming from %s after %d passes\n", checkpoint_file, passes_done);
+  return 1;
+}
+
+//aligned memory for scene data. small arrays are bumped out of shared blocks that
+//stay until everything in them is freed, large ones get a block each that is
+//returned as soon as the array lets go of it
+void *arena_alloc(size_t size)
+{
+  std::lock_guard<std::mutex> guard(arena_lock);
+  ArenaBlock block;
+  
+  size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+  arena_allocations++;
+  arena_in_use += size;
+  if(size <= ARENA_LARGE && arena_current >= 0 && arena_blocks[arena_current].used + size <= arena_blocks[arena_current].size)
+  {
+    ArenaBlock *current = &arena_blocks[arena_current];
+    current->used += size;
+    current->live++;
+    return current->data + current->used - size;
+  }
+  
+  block.size = size <= ARENA_LARGE ? ARENA_BLOCK : size;
+  block.used = size;
+  block.live = 1;
+  block.stranded = 0;
+  if(posix_memalign((void **)&block.data, ARENA_ALIGN, block.size) != 0)
+  {
+    printf("out of memory allocating %.1f MB of scene data\n", block.size / 1048576.0);
+    exit(1);
+  }
+  if(size <= ARENA_LARGE)
+    arena_current = arena_blocks.size();
+  arena_blocks.push_back(block);
+  return block.data;
+}
+
+void arena_free(void *data, size_t size)
+{
+  std::lock_guard<std::mutex> guard(arena_lock);
+  
+  size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+  arena_in_use -= size;
+  for(unsigned int i = 0; i < arena_blocks.size(); i++)
+  {
+    ArenaBlock *block = &arena_blocks[i];
+    if((char *)data < block->data || (char *)data >= block->data + block->size)
+      continue;
+    if(size <= ARENA_LARGE)
+    {
+      block->live--;
+      //the last thing bumped can just be taken back
+      if((int)i == arena_current && (char *)data + size == block->data + block->used)
+        block->used -= size;
+      else
+      {
+        block->stranded += size;
+        arena_stranded += size;
+      }
+      if((int)i == arena_current || block->live > 0)
+        return;
+      arena_stranded -= block->stranded;
+    }
+    free(block->data);
+    arena_blocks.erase(arena_blocks.begin() + i);
+    if(arena_current > (int)i)
+      arena_current--;
+    return;
+  }
+}
+
+void report_arena()
+{
+  size_t reserved = 0;
+  for(unsigned int i = 0; i < arena_blocks.size(); i++)
+    reserved += arena_blocks[i].size;
+  printf("scene arena: %.1f MB in %d blocks, %ld allocations, %.1f MB in use, %.1f MB left by grown arrays\n",
+         reserved / 1048576.0, (int)arena_blocks.size(), arena_allocations, arena_in_use / 1048576.0, arena_stranded / 1048576.0);
+}
+
+//drops every triangle, mesh, instance, light and bvh, handing the arena back at once
+void unload_scene()
+{
+  SceneVector<Triangle>().swap(triangles);
+  SceneVector<real>().swap(vertex_positions);
+  SceneVector<VertexMaterial>().swap(vertex_materials);
+  SceneVector<Mesh>().swap(meshes);
+  SceneVector<Instance>().swap(instances);
+  SceneVector<ImportedFile>().swap(imported_files);
+  SceneVector<BVHNode>().swap(bvh_nodes);
+  SceneVector<int>().swap(bvh_order);
+  SceneVector<WideNode>().swap(wide_nodes);
+  SceneVector<QuantizedNode8>().swap(quantized8_nodes);
+  SceneVector<QuantizedNode16>().swap(quantized16_nodes);
+  SceneVector<BVHNode>().swap(instance_nodes);
+  SceneVector<int>().swap(instance_order);
+  num_triangles = 0;
+  num_spheres = 0;
+  num_lights = 0;
+  num_light_nodes = 0;
+  bvh_root = -1;
+  wide_root = -1;
+  
+  for(unsigned int i = 0; i < arena_blocks.size(); i++)
+    free(arena_blocks[i].data);
+  arena_blocks.clear();
+  arena_current = -1;
+  arena_allocations = 0;
+  arena_in_use = 0;
+  arena_stranded = 0;
+}
+
+//fnv-1a hash of a file's bytes, 0 when it can't be read
+uint64_t hash_file(char *name)
+{
+  static unsigned char chunk[1 << 16];
+  uint64_t hash = 14695981039346656037ULL;
+  FILE *file = fopen(name, "rb");
+  size_t length;
+  
+  if(!file)
+    return 0;
+  while((length = fread(chunk, 1, sizeof(chunk), file)) > 0)
+    for(size_t i = 0; i < length; i++)
+    {
+      hash ^= chunk[i];
+      hash *= 1099511628211ULL;
+    }
+  fclose(file);
+  return hash;
+}
+
+//saves the parsed scene and bvh, written and renamed like a checkpoint
+int write_scene_cache(uint64_t scene_hash)
+{
+  char temp[1024];
+  SceneCacheHeader header;
+  FILE *file;
+  int ok;
+  
+  snprintf(temp, sizeof(temp), "%s.tmp", cache_file);
+  file = fopen(temp, "wb");
+  if(!file)
+  {
+    printf("can't write scene cache %s\n", temp);
+    return 0;
+  }
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, "RTSCN6", 7);
+  header.scene_hash = scene_hash;
+  header.real_size = sizeof(real);
+  header.bvh_builder = bvh_builder;
+  header.num_vertices = vertex_materials.size();
+  header.num_triangles = triangles.size();
+  header.num_spheres = num_spheres;
+  header.num_lights = num_lights;
+  header.num_meshes = meshes.size();
+  header.num_instances = instances.size();
+  header.num_imports = imported_files.size();
+  header.num_nodes = bvh_nodes.size();
+  header.bvh_root = bvh_root;
+  header.bvh_cost = bvh_cost;
+  for(int k = 0; k < 3; k++)
+    header.ambient[k] = ambient_light[k];
+  ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+       fwrite(imported_files.data(), sizeof(ImportedFile), imported_files.size(), file) == imported_files.size() &&
+       fwrite(vertex_positions.data(), sizeof(real), vertex_positions.size(), file) == vertex_positions.size() &&
+       fwrite(vertex_materials.data(), sizeof(VertexMaterial), vertex_materials.size(), file) == vertex_materials.size() &&
+       fwrite(triangles.data(), sizeof(Triangle), triangles.size(), file) == triangles.size() &&
+       fwrite(spheres, sizeof(Sphere), num_spheres, file) == (size_t)num_spheres &&
+       fwrite(lights, sizeof(Light), num_lights, file) == (size_t)num_lights &&
+       fwrite(meshes.data(), sizeof(Mesh), meshes.size(), file) == meshes.size() &&
+       fwrite(instances.data(), sizeof(Instance), instances.size(), file) == instances.size() &&
+       fwrite(bvh_nodes.data(), sizeof(BVHNode), bvh_nodes.size(), file) == bvh_nodes.size() &&
+       fwrite(bvh_order.data(), sizeof(int), bvh_order.size(), file) == bvh_order.size();
+  ok = fclose(file) == 0 && ok;
+  if(!ok || rename(temp, cache_file) != 0)
+  {
+    printf("error writing scene cache %s\n", cache_file);
+    remove(temp);
+    return 0;
+  }
+  printf("scene cache: saved to %s\n", cache_file);
+  return 1;
+}
+
+//maps a scene cache and takes the scene and bvh from it, returns 0 when it was
+//made from another scene file, builder or precision and the scene must be parsed
+int read_scene_cache(uint64_t scene_hash)
+{
+  struct stat info;
+  SceneCacheHeader header;
+  int fd = open(cache_file, O_RDONLY);
+  
+  if(fd < 0)
+  {
+    printf("no scene cache %s, building it\n", cache_file);
+    return 0;
+  }
+  if(fstat(fd, &info) != 0 || info.st_size < (off_t)sizeof(header))
+  {
+    printf("scene cache %s is truncated, rebuilding it\n", cache_file);
+    close(fd);
+    return 0;
+  }
+  char *data = (char *)mmap(0, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(data == MAP_FAILED)
+  {
+    printf("can't map scene cache %s\n", cache_file);
+    return 0;
+  }
+  memcpy(&header, data, sizeof(header));
+  if(memcmp(header.magic, "RTSCN6", 7) != 0 || header.scene_hash != scene_hash || header.real_size != (int)sizeof(real) || header.bvh_builder != bvh_builder)
+  {
+    printf("scene cache %s is for another scene, builder or precision, rebuilding it\n", cache_file);
+    munmap(data, info.st_size);
+    return 0;
+  }
+  int orderSize = header.num_nodes > 0 ? header.num_triangles : 0;
+  size_t size = sizeof(header) + header.num_imports * sizeof(ImportedFile) + header.num_vertices * (3 * sizeof(real) + sizeof(VertexMaterial)) + header.num_triangles * sizeof(Triangle) + header.num_spheres * sizeof(Sphere) +
+                header.num_lights * sizeof(Light) + header.num_meshes * sizeof(Mesh) + header.num_instances * sizeof(Instance) +
+                header.num_nodes * sizeof(BVHNode) + orderSize * sizeof(int);
+  if(header.num_vertices < 0 || header.num_triangles < 0 || header.num_spheres < 0 || header.num_spheres > MAX_SPHERES || header.num_lights < 0 ||
+     header.num_lights > MAX_LIGHTS || header.num_meshes < 0 || header.num_instances < 0 || header.num_imports < 0 || header.num_nodes < 0 ||
+     (size_t)info.st_size != size)
+  {
+    printf("scene cache %s is truncated, rebuilding it\n", cache_file);
+    munmap(data, info.st_size);
+    return 0;
+  }
+  
+  char *next = data + sizeof(header);
+  ImportedFile *imported = (ImportedFile *)next;
+  for(int i = 0; i < header.num_imports; i++)
+    if(hash_file(imported[i].path) != imported[i].hash)
+    {
+      printf("mesh file %s has changed since scene cache %s was made, rebuilding it\n", imported[i].path, cache_file);
+      munmap(data, info.st_size);
+      return 0;
+    }
+  imported_files.assign(imported, imported + header.num_imports);
+  next += header.num_imports * sizeof(ImportedFile);
+  num_spheres = header.num_spheres;
+  num_lights = header.num_lights;
+  for(int k = 0; k < 3; k++)
+    ambient_light[k] = header.ambient[k];
+  vertex_positions.assign((real *)next, (real *)next + 3 * header.num_vertices);
+  next += 3 * header.num_vertices * sizeof(real);
+  vertex_materials.assign((VertexMaterial *)next, (VertexMaterial *)next + header.num_vertices);
+  next += header.num_vertices * sizeof(VertexMaterial);
+  triangles.assign((Triangle *)next, (Triangle *)next + header.num_triangles);
+  next += header.num_triangles * sizeof(Triangle);
+  memcpy(spheres, next, num_spheres * sizeof(Sphere));
+  next += num_spheres * sizeof(Sphere);
+  memcpy(lights, next, num_lights * sizeof(Light));
+  next += num_lights * sizeof(Light);
+  meshes.assign((Mesh *)next, (Mesh *)next + header.num_meshes);
+  next += header.num_meshes * sizeof(Mesh);
+  instances.assign((Instance *)next, (Instance *)next + header.num_instances);
+  next += header.num_instances * sizeof(Instance);
+  //the scene's own triangles are the ones before the first mesh
+  num_triangles = meshes.empty() ? header.num_triangles : meshes[0].first;
+  bvh_root = header.bvh_root;
+  bvh_cost = header.bvh_cost;
+  bvh_nodes.assign((BVHNode *)next, (BVHNode *)next + header.num_nodes);
+  next += header.num_nodes * sizeof(BVHNode);
+  bvh_order.assign((int *)next, (int *)next + orderSize);
+  munmap(data, info.st_size);
+  printf("scene cache: %d vertices, %d triangles, %d spheres, %d lights, %d meshes, %d instances and %d bvh nodes from %s\n",
+         header.num_vertices, header.num_triangles, num_spheres, num_lights, header.num_meshes, header.num_instances, header.num_nodes, cache_file);
+  return 1;
+}
+
+//follows one path from the camera, adding the direct light at every bounce.
+//lights have no falloff, as in the phong mode, and surfaces are lambertian
+void trace_path(Ray ray, unsigned int *seed, double *radiance)
 {
-  glColor3f(((double)r)/256.f,((double)g)/256.f,((double)b)/256.f);
-  glVertex2i(x,y);
+  double throughput[3] = {1, 1, 1};
+  
+  radiance[0] = 0;
+  radiance[1] = 0;
+  radiance[2] = 0;
+  
+  for(int depth = 0; depth < max_depth; depth++)
+  {
+    Intersection hit;
+    real normal[3];
+    double albedo[3];
+    double direct[3];
+    
+    rays_traced++;
+    if(!closest_hit(ray, &hit))
+      break;
+    hit_surface(ray, hit, normal, albedo);
+    
+    //light reaching this point straight from the lights
+    nextEventEstimate(hit, normal, seed, direct);
+    for(int c = 0; c < 3; c++)
+      radiance[c] += throughput[c] * albedo[c] * direct[c];
+    
+    //the bounce is cosine weighted, so the cosine and pdf cancel and only the albedo is left
+    for(int c = 0; c < 3; c++)
+      throughput[c] *= albedo[c];
+    
+    //russian roulette once the path has had a few bounces
+    if(depth >= 2)
+    {
+      double survive = std::min(0.95, std::max(throughput[0], std::max(throughput[1], throughput[2])));
+      if(random_double(seed) >= survive)
+        break;
+      for(int c = 0; c < 3; c++)
+        throughput[c] /= survive;
+    }
+    
+    cosine_bounce(hit, normal, seed, &ray);
+  }
+}
+
+//nearest sphere or triangle along the ray, false if it escapes
+bool closest_hit(Ray ray, Intersection *hit)
+{
+  Intersection triIntersection = check_triangles(ray);
+  Intersection sphereIntersection = check_spheres(ray);
+  if((triIntersection.time < sphereIntersection.time || sphereIntersection.time < 0) && triIntersection.time >= 0)
+    *hit = triIntersection;
+  else if(sphereIntersection.time >= 0)
+    *hit = sphereIntersection;
+  else
+    return false;
+  return true;
 }
 
-void plot_pixel_jpeg(int x,int y,unsigned char r,unsigned char g,unsigned char b)
+//normal facing back along the ray and diffuse color at a path vertex
+void hit_surface(Ray ray, Intersection hit, real *normal, double *albedo)
 {
-  buffer[HEIGHT-y-1][x][0]=r;
-  buffer[HEIGHT-y-1][x][1]=g;
-  buffer[HEIGHT-y-1][x][2]=b;
+  surfaceNormal(hit, normal);
+  //face the normal back toward where the ray came from
+  if((normal[0] * ray.direction[0]) + (normal[1] * ray.direction[1]) + (normal[2] * ray.direction[2]) > 0)
+  {
+    normal[0] = -normal[0];
+    normal[1] = -normal[1];
+    normal[2] = -normal[2];
+  }
+  for(int c = 0; c < 3; c++)
+    albedo[c] = hit.triangle != NULL ? calcTriangleColor(hit, c) : getSphereColor(hit, c);
 }
 
-void plot_pixel(int x,int y,unsigned char r,unsigned char g, unsigned char b)
+//sends the ray off the hit in a cosine weighted direction about the normal
+void cosine_bounce(Intersection hit, real *normal, unsigned int *seed, Ray *ray)
 {
-  plot_pixel_display(x,y,r,g,b);
-  if(mode == MODE_JPEG)
-      plot_pixel_jpeg(x,y,r,g,b);
+  //build a frame around the normal and pick a cosine weighted direction
+  real tangent[3];
+  real bitangent[3];
+  real helper[3] = {0, 0, 0};
+  if(std::abs(normal[0]) > 0.1)
+    helper[1] = 1;
+  else
+    helper[0] = 1;
+  tangent[0] = (helper[1] * normal[2]) - (helper[2] * normal[1]);
+  tangent[1] = (helper[2] * normal[0]) - (helper[0] * normal[2]);
+  tangent[2] = (helper[0] * normal[1]) - (helper[1] * normal[0]);
+  real tangentLength = std::sqrt(square(tangent[0]) + square(tangent[1]) + square(tangent[2]));
+  tangent[0] /= tangentLength;
+  tangent[1] /= tangentLength;
+  tangent[2] /= tangentLength;
+  bitangent[0] = (normal[1] * tangent[2]) - (normal[2] * tangent[1]);
+  bitangent[1] = (normal[2] * tangent[0]) - (normal[0] * tangent[2]);
+  bitangent[2] = (normal[0] * tangent[1]) - (normal[1] * tangent[0]);
+  
+  double angle = 2 * M_PI * random_double(seed);
+  double radius2 = random_double(seed);
+  double radius = sqrt(radius2);
+  double up = sqrt(1 - radius2);
+  
+  offset_ray_origin(hit.position, normal, ray->position);
+  for(int k = 0; k < 3; k++)
+    ray->direction[k] = (tangent[k] * cos(angle) * radius) + (bitangent[k] * sin(angle) * radius) + (normal[k] * up);
+  prepare_ray(ray);
+}
+
+//colored light arriving at the point from every light, sampled with the light tree when there are many
+void nextEventEstimate(Intersection hit, real *normal, unsigned int *seed, double *direct)
+{
+  direct[0] = 0;
+  direct[1] = 0;
+  direct[2] = 0;
+  
+  if(light_samples <= 0 || num_lights <= light_samples)
+  {
+    for(int i = 0; i < num_lights; i++)
+    {
+      double contribution = lightContribution(hit, normal, i);
+      if(contribution > 0)
+        for(int c = 0; c < 3; c++)
+          direct[c] += lights[i].color[c] * contribution;
+    }
+    return;
+  }
+  
+  for(int i = 0; i < light_samples; i++)
+  {
+    double pdf;
+    int light = sample_light_tree(hit.position, normal, random_double(seed), &pdf);
+    if(light < 0)
+      continue;
+    double contribution = lightContribution(hit, normal, light);
+    if(contribution > 0)
+      for(int c = 0; c < 3; c++)
+        direct[c] += lights[light].color[c] * contribution / pdf;
+  }
+  for(int c = 0; c < 3; c++)
+    direct[c] /= light_samples;
+}
+
+//averages the accumulated samples and converts them to 8 bits, once per pixel.
+//each row is done as flat float loops the compiler can vectorize
+void tone_map()
+{
+  static float scale[WIDTH * 3];
+  static float mapped[WIDTH * 3];
+  
+  for(int y = 0; y < HEIGHT; y++)
+  {
+    const float *sums = accumulation[y][0];
+    unsigned char *out = buffer[HEIGHT - y - 1][0];
+    
+    for(int x = 0; x < WIDTH; x++)
+    {
+      float pixelScale = sample_counts[y][x] > 0 ? exposure / sample_counts[y][x] : 0.0f;
+      scale[3 * x] = pixelScale;
+      scale[3 * x + 1] = pixelScale;
+      scale[3 * x + 2] = pixelScale;
+    }
+    
+    if(tone_operator == TONE_REINHARD)
+    {
+      for(int i = 0; i < WIDTH * 3; i++)
+      {
+        float value = std::max(sums[i] * scale[i], 0.0f);
+        mapped[i] = value / (1.0f + value);
+      }
+    }
+    else
+    {
+      for(int i = 0; i < WIDTH * 3; i++)
+        mapped[i] = std::min(std::max(sums[i] * scale[i], 0.0f), 1.0f);
+    }
+    
+    //linear output truncates like the old per-pixel conversion did
+    if(display_gamma == 1.0f)
+    {
+      for(int i = 0; i < WIDTH * 3; i++)
+        out[i] = (unsigned char)(mapped[i] * 255.0f);
+    }
+    else
+    {
+      for(int i = 0; i < WIDTH * 3; i++)
+        out[i] = gamma_table[(int)(mapped[i] * (GAMMA_TABLE_SIZE - 1) + 0.5f)];
+    }
+  }
+}
+
+//precomputes the gamma curve so tone_map doesn't call pow per channel
+void build_gamma_table()
+{
+  for(int i = 0; i < GAMMA_TABLE_SIZE; i++)
+    gamma_table[i] = (unsigned char)(pow(i / (double)(GAMMA_TABLE_SIZE - 1), 1.0 / display_gamma) * 255.0 + 0.5);
+}
+
+//draws the tone mapped image
+void show_buffer()
+{
+  for(int x = 0; x < WIDTH; x++)
+  {
+    glPointSize(2.0);
+    glBegin(GL_POINTS);
+    for(int y = 0; y < HEIGHT; y++)
+      plot_pixel_display(x, y, buffer[HEIGHT - y - 1][x][0], buffer[HEIGHT - y - 1][x][1], buffer[HEIGHT - y - 1][x][2]);
+    glEnd();
+    glFlush();
+  }
+}
+
+//hashes a pixel and pass into a nonzero seed (Wang hash)
+unsigned int pixel_seed(unsigned int x, unsigned int y, unsigned int pass)
+{
+  unsigned int seed = (y * WIDTH + x) ^ (pass * 0x9E3779B9u);
+  seed = (seed ^ 61) ^ (seed >> 16);
+  seed *= 9;
+  seed ^= seed >> 4;
+  seed *= 0x27d4eb2d;
+  seed ^= seed >> 15;
+  return seed | 1;
+}
+
+void plot_pixel_display(int x,int y,unsigned char r,unsigned char g,unsigned char b)
+{
+  glColor3f(((double)r)/256.f,((double)g)/256.f,((double)b)/256.f);
+  glVertex2i(x,y);
+}
+
+//true when a previous render has been saved under name
+bool file_exists(char *name)
+{
+  FILE *file = fopen(name, "rb");
+  if(file)
+    fclose(file);
+  return file != NULL;
 }
 
 void save_jpg()
 {
   Pic *in = NULL;
+  int left = 0, top = 0;
 
-  in = pic_alloc(640, 480, 3, NULL);
+  //patching writes the crop into the full image saved before
+  if(patch_output && file_exists(filename))
+  {
+    in = jpeg_read(filename, NULL);
+    if(!in || in->nx != WIDTH || in->ny != HEIGHT || in->bpp != 3)
+    {
+      printf("%s is not a %dx%d rgb image, can't patch it\n", filename, WIDTH, HEIGHT);
+      if(in)
+        pic_free(in);
+      return;
+    }
+  }
+  else if(patch_output)
+  {
+    in = pic_alloc(WIDTH, HEIGHT, 3, NULL);
+    memset(in->pix, 0, 3 * WIDTH * HEIGHT);
+  }
+  else
+    in = pic_alloc(crop_right - crop_left, crop_bottom - crop_top, 3, NULL);
+  if(patch_output)
+  {
+    left = crop_left;
+    top = crop_top;
+  }
   printf("Saving JPEG file: %s\n", filename);
 
-  memcpy(in->pix,buffer,3*WIDTH*HEIGHT);
+  for(int y = crop_top; y < crop_bottom; y++)
+    memcpy(&PIC_PIXEL(in, left, top + y - crop_top, 0), buffer[y][crop_left], 3 * (crop_right - crop_left));
   if (jpeg_write(filename, in))
     printf("File saved Successfully\n");
   else
@@ -497,62 +4131,704 @@ void save_jpg()
 
 }
 
-void parse_check(char *expected,char *found)
+//write the averaged radiance before tone mapping, for .pfm and .hdr names
+void save_hdr()
+{
+  FPic *out = NULL;
+  int left = 0, top = 0;
+
+  if(patch_output && file_exists(filename))
+  {
+    out = fpic_read(filename, NULL);
+    if(!out || out->nx != WIDTH || out->ny != HEIGHT || out->nc != 3)
+    {
+      printf("%s is not a %dx%d rgb image, can't patch it\n", filename, WIDTH, HEIGHT);
+      if(out)
+        fpic_free(out);
+      return;
+    }
+  }
+  else if(patch_output)
+  {
+    out = fpic_alloc(WIDTH, HEIGHT, 3, NULL);
+    memset(out->pix, 0, sizeof(PixelF) * 3 * WIDTH * HEIGHT);
+  }
+  else
+    out = fpic_alloc(crop_right - crop_left, crop_bottom - crop_top, 3, NULL);
+  if(patch_output)
+  {
+    left = crop_left;
+    top = crop_top;
+  }
+  printf("Saving HDR file: %s\n", filename);
+
+  //accumulation is y-up, pictures are top row first
+  for(int row = crop_top; row < crop_bottom; row++)
+    for(int x = crop_left; x < crop_right; x++)
+    {
+      int y = HEIGHT - 1 - row;
+      for(int c = 0; c < 3; c++)
+        FPIC_PIXEL(out, left + x - crop_left, top + row - crop_top, c) = sample_counts[y][x] ? accumulation[y][x][c] / sample_counts[y][x] : 0;
+    }
+
+  if (fpic_write(filename, out, pic_filename_type(filename)))
+    printf("File saved Successfully\n");
+  else
+    printf("Error in Saving\n");
+
+  fpic_free(out);
+}
+
+void save_image()
+{
+  int type = pic_filename_type(filename);
+  if(type == PIC_PFM_FILE || type == PIC_HDR_FILE)
+    save_hdr();
+  else
+    save_jpg();
+}
+
+//load a saved hdr render in place of a scene so it can be tone mapped again
+int load_hdr(char *file)
+{
+  FPic *in = fpic_read(file, NULL);
+  if(!in)
+    return 0;
+  if(in->nx != WIDTH || in->ny != HEIGHT || in->nc != 3)
+  {
+    printf("%s is %dx%d with %d channels, expected %dx%d rgb\n", file, in->nx, in->ny, in->nc, WIDTH, HEIGHT);
+    fpic_free(in);
+    return 0;
+  }
+  for(int y = 0; y < HEIGHT; y++)
+    for(int x = 0; x < WIDTH; x++)
+    {
+      for(int c = 0; c < 3; c++)
+        accumulation[y][x][c] = FPIC_PIXEL(in, x, HEIGHT - 1 - y, c);
+      sample_counts[y][x] = 1;
+    }
+  fpic_free(in);
+  return 1;
+}
+
+//the parse functions return 0 after printing what was wrong
+int parse_check(const char *expected,const char *found)
 {
   if(strcasecmp(expected,found))
     {
       char error[100];
       printf("Expected '%s ' found '%s '\n",expected,found);
       printf("Parse error, abnormal abortion\n");
-      exit(0);
+      return 0;
     }
-
+  return 1;
 }
 
-void parse_doubles(FILE*file, char *check, double p[3])
+int parse_doubles(FILE*file, const char *check, real p[3])
 {
-  char str[100];
+  char str[100] = "";
+  double d[3];
   fscanf(file,"%s",str);
-  parse_check(check,str);
-  fscanf(file,"%lf %lf %lf",&p[0],&p[1],&p[2]);
-  printf("%s %lf %lf %lf\n",check,p[0],p[1],p[2]);
+  if(!parse_check(check,str))
+    return 0;
+  fscanf(file,"%lf %lf %lf",&d[0],&d[1],&d[2]);
+  printf("%s %lf %lf %lf\n",check,d[0],d[1],d[2]);
+  p[0] = d[0];
+  p[1] = d[1];
+  p[2] = d[2];
+  return 1;
 }
 
-void parse_rad(FILE*file,double *r)
+int parse_rad(FILE*file,real *r)
 {
-  char str[100];
+  char str[100] = "";
+  double d;
   fscanf(file,"%s",str);
-  parse_check("rad:",str);
-  fscanf(file,"%lf",r);
-  printf("rad: %f\n",*r);
+  if(!parse_check("rad:",str))
+    return 0;
+  fscanf(file,"%lf",&d);
+  printf("rad: %f\n",d);
+  *r = d;
+  return 1;
+}
+
+int parse_shi(FILE*file,real *shi)
+{
+  char s[100] = "";
+  double d;
+  fscanf(file,"%s",s);
+  if(!parse_check("shi:",s))
+    return 0;
+  fscanf(file,"%lf",&d);
+  printf("shi: %f\n",d);
+  *shi = d;
+  return 1;
+}
+
+int parse_name(FILE*file,char *name)
+{
+  char s[100] = "";
+  fscanf(file,"%s",s);
+  if(!parse_check("name:",s))
+    return 0;
+  fscanf(file,"%63s",name);
+  printf("name: %s\n",name);
+  return 1;
+}
+
+//vertices are only shared when every attribute matches bit for bit
+struct VertexHash
+{
+  size_t operator()(const Vertex &v) const
+  {
+    const unsigned char *bytes = (const unsigned char *)&v;
+    uint64_t hash = 14695981039346656037ULL;
+    for(size_t i = 0; i < sizeof(Vertex); i++)
+      {
+	hash ^= bytes[i];
+	hash *= 1099511628211ULL;
+      }
+    return hash;
+  }
+};
+
+struct VertexEqual
+{
+  bool operator()(const Vertex &a, const Vertex &b) const { return memcmp(&a, &b, sizeof(Vertex)) == 0; }
+};
+
+//index of each vertex already loaded, only kept while loading
+std::unordered_map<Vertex, int, VertexHash, VertexEqual> vertex_lookup;
+
+//everything but the position of v, which rays search separately
+VertexMaterial vertex_material(const Vertex &v)
+{
+  VertexMaterial material;
+  memcpy(material.color_diffuse, v.color_diffuse, sizeof(material.color_diffuse));
+  memcpy(material.color_specular, v.color_specular, sizeof(material.color_specular));
+  memcpy(material.normal, v.normal, sizeof(material.normal));
+  material.shininess = v.shininess;
+  return material;
+}
+
+//index of v, adding its position and material the first time it is seen
+int add_vertex(Vertex &v)
+{
+  std::pair<std::unordered_map<Vertex, int, VertexHash, VertexEqual>::iterator, bool> found =
+    vertex_lookup.insert(std::make_pair(v, (int)vertex_materials.size()));
+  if(found.second)
+    {
+      vertex_positions.insert(vertex_positions.end(), v.position, v.position + 3);
+      vertex_materials.push_back(vertex_material(v));
+    }
+  return found.first->second;
+}
+
+int parse_triangle(FILE*file,Triangle *t)
+{
+  int j;
+  Vertex v;
+
+  for(j=0;j < 3;j++)
+    {
+      if(!parse_doubles(file,"pos:",v.position) || !parse_doubles(file,"nor:",v.normal) ||
+	 !parse_doubles(file,"dif:",v.color_diffuse) || !parse_doubles(file,"spe:",v.color_specular) ||
+	 !parse_shi(file,&v.shininess))
+	return 0;
+      t->v[j] = add_vertex(v);
+    }
+  return 1;
+}
+
+//whole file in memory, NULL if it can't be read
+char *read_file(char *name, size_t *size)
+{
+  FILE *file = fopen(name, "rb");
+  char *data;
+
+  if(!file)
+    return NULL;
+  fseek(file, 0, SEEK_END);
+  *size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  data = (char *)malloc(*size + 1);
+  if(!data || fread(data, 1, *size, file) != *size)
+    {
+      free(data);
+      fclose(file);
+      return NULL;
+    }
+  data[*size] = 0;
+  fclose(file);
+  return data;
+}
+
+//wavefront obj: v lines, with an rgb color after the position in some exporters,
+//vn normals and f faces of any size fanned into triangles. every distinct pair
+//of position and normal used by a face becomes a vertex
+int import_obj(char *name, VertexMaterial *material, std::vector<Triangle> &out)
+{
+  size_t size;
+  char *data = read_file(name, &size);
+  std::vector<real> positions, colors, normals;
+  std::unordered_map<uint64_t, int> corners;
+  std::vector<int> face;
+
+  if(!data)
+    {
+      printf("can't read mesh file %s\n", name);
+      return 0;
+    }
+  char *line = data;
+  while(*line)
+    {
+      char *end = line + strcspn(line, "\r\n");
+      char *next = *end ? end + 1 : end;
+      *end = 0;
+      while(*line == ' ' || *line == '\t')
+	line++;
+      if(line[0] == 'v' && line[1] == ' ')
+	{
+	  real value[6];
+	  int count = 0;
+	  char *p = line + 2, *q;
+	  while(count < 6 && (value[count] = strtod(p, &q), q != p))
+	    {
+	      count++;
+	      p = q;
+	    }
+	  if(count < 3)
+	    {
+	      printf("bad vertex in %s: %s\n", name, line);
+	      free(data);
+	      return 0;
+	    }
+	  positions.insert(positions.end(), value, value + 3);
+	  for(int k = 0; k < 3; k++)
+	    colors.push_back(count == 6 ? value[3 + k] : material->color_diffuse[k]);
+	}
+      else if(line[0] == 'v' && line[1] == 'n' && line[2] == ' ')
+	{
+	  char *p = line + 3;
+	  for(int k = 0; k < 3; k++)
+	    normals.push_back(strtod(p, &p));
+	}
+      else if(line[0] == 'f' && line[1] == ' ')
+	{
+	  char *p = line + 2;
+	  face.clear();
+	  for(;;)
+	    {
+	      char *q;
+	      long v = strtol(p, &q, 10), vn = 0;
+	      if(q == p)
+		break;
+	      p = q;
+	      //v, v/vt, v//vn or v/vt/vn, negative indices count back from the end
+	      if(*p == '/')
+		{
+		  strtol(p + 1, &q, 10);
+		  p = q;
+		  if(*p == '/')
+		    vn = strtol(p + 1, &p, 10);
+		}
+	      v = v < 0 ? v + positions.size() / 3 : v - 1;
+	      vn = vn < 0 ? vn + normals.size() / 3 : vn - 1;
+	      if(v < 0 || v >= (long)positions.size() / 3 || vn >= (long)normals.size() / 3)
+		{
+		  printf("bad face in %s: %s\n", name, line);
+		  free(data);
+		  return 0;
+		}
+	      uint64_t key = ((uint64_t)v << 32) | (uint32_t)(vn + 1);
+	      std::pair<std::unordered_map<uint64_t, int>::iterator, bool> found =
+		corners.insert(std::make_pair(key, (int)vertex_materials.size()));
+	      if(found.second)
+		{
+		  VertexMaterial corner = *material;
+		  memcpy(corner.color_diffuse, &colors[3 * v], sizeof(corner.color_diffuse));
+		  if(vn >= 0)
+		    memcpy(corner.normal, &normals[3 * vn], sizeof(corner.normal));
+		  vertex_positions.insert(vertex_positions.end(), &positions[3 * v], &positions[3 * v] + 3);
+		  vertex_materials.push_back(corner);
+		}
+	      face.push_back(found.first->second);
+	    }
+	  for(unsigned int j = 2; j < face.size(); j++)
+	    {
+	      Triangle t = {{face[0], face[j - 1], face[j]}};
+	      out.push_back(t);
+	    }
+	}
+      line = next;
+    }
+  free(data);
+  return 1;
+}
+
+//scalar types a ply property can have
+enum PlyType {PLY_INT8, PLY_UINT8, PLY_INT16, PLY_UINT16, PLY_INT32, PLY_UINT32, PLY_FLOAT32, PLY_FLOAT64};
+
+typedef struct _PlyProperty
+{
+  char name[32];
+  int type;
+  //lists have a count of count_type before that many items of type
+  int list;
+  int count_type;
+} PlyProperty;
+
+typedef struct _PlyElement
+{
+  char name[32];
+  long count;
+  std::vector<PlyProperty> properties;
+} PlyElement;
+
+int ply_type(char *name)
+{
+  const char *names[][2] = {{"char", "int8"}, {"uchar", "uint8"}, {"short", "int16"}, {"ushort", "uint16"},
+                            {"int", "int32"}, {"uint", "uint32"}, {"float", "float32"}, {"double", "float64"}};
+  for(int i = 0; i < 8; i++)
+    if(strcmp(name, names[i][0]) == 0 || strcmp(name, names[i][1]) == 0)
+      return i;
+  return -1;
 }
 
-void parse_shi(FILE*file,double *shi)
-{
-  char s[100];
-  fscanf(file,"%s",s);
-  parse_check("shi:",s);
-  fscanf(file,"%lf",shi);
-  printf("shi: %f\n",*shi);
+int ply_size(int type)
+{
+  static const int sizes[] = {1, 1, 2, 2, 4, 4, 4, 8};
+  return sizes[type];
+}
+
+//value of type at data, byte swapped first when the file's endianness isn't ours
+double ply_value(const unsigned char *data, int type, bool swap)
+{
+  unsigned char bytes[8];
+  int size = ply_size(type);
+  for(int i = 0; i < size; i++)
+    bytes[i] = data[swap ? size - 1 - i : i];
+  switch(type)
+    {
+    case PLY_INT8: return *(int8_t *)bytes;
+    case PLY_UINT8: return *(uint8_t *)bytes;
+    case PLY_INT16: { int16_t v; memcpy(&v, bytes, 2); return v; }
+    case PLY_UINT16: { uint16_t v; memcpy(&v, bytes, 2); return v; }
+    case PLY_INT32: { int32_t v; memcpy(&v, bytes, 4); return v; }
+    case PLY_UINT32: { uint32_t v; memcpy(&v, bytes, 4); return v; }
+    case PLY_FLOAT32: { float v; memcpy(&v, bytes, 4); return v; }
+    default: { double v; memcpy(&v, bytes, 8); return v; }
+    }
+}
+
+//binary ply, either byte order. everything after the header is read in one go
+//and the vertex element taken from it as fixed size records, with x y z and
+//optionally nx ny nz and red green blue. faces are vertex_indices lists fanned
+//into triangles, other elements are skipped
+int import_ply(char *name, VertexMaterial *material, std::vector<Triangle> &out)
+{
+  size_t size;
+  char *data = read_file(name, &size);
+  std::vector<PlyElement> elements;
+  bool swap = false;
+  unsigned int one = 1;
+  bool little = *(unsigned char *)&one == 1;
+
+  if(!data || strncmp(data, "ply", 3) != 0)
+    {
+      printf("can't read mesh file %s\n", name);
+      free(data);
+      return 0;
+    }
+  //header lines up to end_header
+  char *line = data, *body = NULL;
+  while(!body && *line)
+    {
+      char *end = strchr(line, '\n');
+      char word[5][32];
+      if(!end)
+	break;
+      *end = 0;
+      int words = sscanf(line, "%31s %31s %31s %31s %31s", word[0], word[1], word[2], word[3], word[4]);
+      if(words >= 2 && strcmp(word[0], "format") == 0)
+	{
+	  if(strcmp(word[1], "ascii") == 0)
+	    {
+	      printf("%s is an ascii ply, only binary ply files are supported\n", name);
+	      free(data);
+	      return 0;
+	    }
+	  swap = (strcmp(word[1], "binary_little_endian") == 0) != little;
+	}
+      else if(words == 3 && strcmp(word[0], "element") == 0)
+	{
+	  PlyElement element;
+	  strcpy(element.name, word[1]);
+	  element.count = atol(word[2]);
+	  elements.push_back(element);
+	}
+      else if(words >= 3 && strcmp(word[0], "property") == 0 && !elements.empty())
+	{
+	  PlyProperty property;
+	  property.list = words == 5 && strcmp(word[1], "list") == 0;
+	  property.count_type = property.list ? ply_type(word[2]) : -1;
+	  property.type = ply_type(word[property.list ? 3 : 1]);
+	  strcpy(property.name, word[property.list ? 4 : 2]);
+	  if(property.type < 0 || (property.list && property.count_type < 0))
+	    {
+	      printf("unknown property type in %s: %s\n", name, line);
+	      free(data);
+	      return 0;
+	    }
+	  elements.back().properties.push_back(property);
+	}
+      else if(words == 1 && strcmp(word[0], "end_header") == 0)
+	body = end + 1;
+      line = end + 1;
+    }
+  if(!body)
+    {
+      printf("%s has no end_header\n", name);
+      free(data);
+      return 0;
+    }
+
+  const unsigned char *next = (const unsigned char *)body;
+  const unsigned char *last = (const unsigned char *)data + size;
+  int firstVertex = vertex_materials.size();
+  long vertices = 0;
+  for(unsigned int e = 0; e < elements.size(); e++)
+    {
+      PlyElement *element = &elements[e];
+      std::vector<PlyProperty> &properties = element->properties;
+      if(strcmp(element->name, "vertex") == 0)
+	{
+	  //offsets of the fields we use in each fixed size record, -1 if missing
+	  const char *fields[9] = {"x", "y", "z", "nx", "ny", "nz", "red", "green", "blue"};
+	  int offset[9], type[9], stride = 0;
+	  for(int f = 0; f < 9; f++)
+	    offset[f] = -1;
+	  for(unsigned int i = 0; i < properties.size(); i++)
+	    {
+	      if(properties[i].list)
+		{
+		  printf("%s: list property in the vertex element\n", name);
+		  free(data);
+		  return 0;
+		}
+	      for(int f = 0; f < 9; f++)
+		if(strcmp(properties[i].name, fields[f]) == 0)
+		  {
+		    offset[f] = stride;
+		    type[f] = properties[i].type;
+		  }
+	      stride += ply_size(properties[i].type);
+	    }
+	  if(offset[0] < 0 || offset[1] < 0 || offset[2] < 0 || (size_t)(last - next) < (size_t)element->count * stride)
+	    {
+	      printf("%s: vertex element without x y z or truncated\n", name);
+	      free(data);
+	      return 0;
+	    }
+	  vertices = element->count;
+	  vertex_positions.reserve(vertex_positions.size() + 3 * vertices);
+	  vertex_materials.reserve(vertex_materials.size() + vertices);
+	  for(long i = 0; i < vertices; i++, next += stride)
+	    {
+	      VertexMaterial corner = *material;
+	      for(int k = 0; k < 3; k++)
+		{
+		  vertex_positions.push_back(ply_value(next + offset[k], type[k], swap));
+		  if(offset[3 + k] >= 0)
+		    corner.normal[k] = ply_value(next + offset[3 + k], type[3 + k], swap);
+		  //integer colors are 0-255
+		  if(offset[6 + k] >= 0)
+		    corner.color_diffuse[k] = ply_value(next + offset[6 + k], type[6 + k], swap) /
+		                              (type[6 + k] == PLY_FLOAT32 || type[6 + k] == PLY_FLOAT64 ? 1 : 255);
+		}
+	      vertex_materials.push_back(corner);
+	    }
+	  continue;
+	}
+
+      bool faces = strcmp(element->name, "face") == 0;
+      int corners[256];
+      for(long i = 0; i < element->count; i++)
+	for(unsigned int j = 0; j < properties.size(); j++)
+	  {
+	    PlyProperty *property = &properties[j];
+	    long count = 1;
+	    if(property->list && next + ply_size(property->count_type) <= last)
+	      {
+		count = (long)ply_value(next, property->count_type, swap);
+		next += ply_size(property->count_type);
+	      }
+	    else if(property->list)
+	      count = -1;
+	    if(count < 0 || next + count * ply_size(property->type) > last)
+	      {
+		printf("%s is truncated\n", name);
+		free(data);
+		return 0;
+	      }
+	    if(faces && property->list && (strcmp(property->name, "vertex_indices") == 0 || strcmp(property->name, "vertex_index") == 0))
+	      {
+		if(count > 256)
+		  {
+		    printf("%s: face with more than 256 corners\n", name);
+		    free(data);
+		    return 0;
+		  }
+		for(long k = 0; k < count; k++)
+		  {
+		    long v = (long)ply_value(next + k * ply_size(property->type), property->type, swap);
+		    if(v < 0 || v >= vertices)
+		      {
+			printf("%s: face corner %ld out of range\n", name, v);
+			free(data);
+			return 0;
+		      }
+		    corners[k] = firstVertex + v;
+		  }
+		for(long k = 2; k < count; k++)
+		  {
+		    Triangle t = {{corners[0], corners[k - 1], corners[k]}};
+		    out.push_back(t);
+		  }
+	      }
+	    next += count * ply_size(property->type);
+	  }
+    }
+  free(data);
+  return 1;
+}
+
+//mesh file named relative to the scene file, read by its extension
+int import_mesh(char *scene, char *name, VertexMaterial *material, std::vector<Triangle> &out)
+{
+  char path[1024];
+  const char *slash = strrchr(scene, '/');
+  const char *extension = strrchr(name, '.');
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  int firstVertex = vertex_materials.size();
+  int firstTriangle = out.size();
+  ImportedFile imported;
+  int ok;
+
+  if(name[0] == '/' || !slash)
+    snprintf(path, sizeof(path), "%s", name);
+  else
+    snprintf(path, sizeof(path), "%.*s/%s", (int)(slash - scene), scene, name);
+  if(extension && strcasecmp(extension, ".obj") == 0)
+    ok = import_obj(path, material, out);
+  else if(extension && strcasecmp(extension, ".ply") == 0)
+    ok = import_ply(path, material, out);
+  else
+    {
+      printf("unknown mesh file type %s, expected .obj or .ply\n", name);
+      return 0;
+    }
+  if(!ok)
+    return 0;
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  printf("imported %s: %d vertices, %d triangles in %.2f s\n", path, (int)vertex_materials.size() - firstVertex,
+	 (int)out.size() - firstTriangle, seconds);
+
+  //so a scene cache notices the mesh changing
+  snprintf(imported.path, sizeof(imported.path), "%s", path);
+  imported.hash = hash_file(path);
+  imported_files.push_back(imported);
+  return 1;
+}
+
+int parse_transform(FILE*file,Instance *instance)
+{
+  real position[3], rotation[3], scale[3];
+
+  if(!parse_doubles(file,"pos:",position) || !parse_doubles(file,"rot:",rotation) ||
+     !parse_doubles(file,"sca:",scale))
+    return 0;
+  if(!set_transform(instance,position,rotation,scale))
+    {
+      printf("instance scale can't be zero\n");
+      return 0;
+    }
+  return 1;
+}
+
+//instance placement: scale, then rotate about x, y and z in degrees, then move.
+//0 when a zero scale leaves it without an inverse
+int set_transform(Instance *instance, real *position, real *rotation, real *scale)
+{
+  double m[3][3] = {{1,0,0},{0,1,0},{0,0,1}};
+
+  for(int axis = 0; axis < 3; axis++)
+    {
+      double angle = rotation[axis] * M_PI / 180;
+      double c = cos(angle), s = sin(angle);
+      int a = (axis + 1) % 3, b = (axis + 2) % 3;
+      //rotate the rows already in m, so later axes apply after earlier ones
+      for(int j = 0; j < 3; j++)
+	{
+	  double ma = m[a][j], mb = m[b][j];
+	  m[a][j] = c * ma - s * mb;
+	  m[b][j] = s * ma + c * mb;
+	}
+    }
+  for(int k = 0; k < 3; k++)
+    {
+      for(int j = 0; j < 3; j++)
+	instance->transform[k][j] = m[k][j] * scale[j];
+      instance->transform[k][3] = position[k];
+    }
+
+  //inverse from the cofactors of the 3x3 part
+  real (*t)[4] = instance->transform;
+  double det = t[0][0] * (t[1][1] * t[2][2] - t[1][2] * t[2][1]) -
+               t[0][1] * (t[1][0] * t[2][2] - t[1][2] * t[2][0]) +
+               t[0][2] * (t[1][0] * t[2][1] - t[1][1] * t[2][0]);
+  if(det == 0)
+    return 0;
+  for(int k = 0; k < 3; k++)
+    for(int j = 0; j < 3; j++)
+      {
+	int j1 = (j + 1) % 3, j2 = (j + 2) % 3, k1 = (k + 1) % 3, k2 = (k + 2) % 3;
+	instance->inverse[k][j] = (t[j1][k1] * t[j2][k2] - t[j1][k2] * t[j2][k1]) / det;
+      }
+  for(int k = 0; k < 3; k++)
+    instance->inverse[k][3] = -(instance->inverse[k][0] * t[0][3] + instance->inverse[k][1] * t[1][3] + instance->inverse[k][2] * t[2][3]);
+  return 1;
 }
 
+//reads the scene file, echoing every value. 0 after printing what was wrong if
+//it can't be read
 int loadScene(char *argv)
 {
   FILE *file = fopen(argv,"r");
   int number_of_objects;
-  char type[50];
+  char type[50] = "";
   int i;
+  int ok;
   Triangle t;
   Sphere s;
   Light l;
+  Mesh mesh;
+  Instance instance;
+  //mesh triangles go after the scene's own once everything is read
+  std::vector<Triangle> mesh_triangles;
+  if(!file)
+    {
+      printf("can't read scene file %s\n",argv);
+      return 0;
+    }
   fscanf(file,"%i",&number_of_objects);
 
   printf("number of objects: %i\n",number_of_objects);
-  char str[200];
+  char str[200] = "";
 
-  parse_doubles(file,"amb:",ambient_light);
+  ok = parse_doubles(file,"amb:",ambient_light);
 
-  for(i=0;i < number_of_objects;i++)
+  for(i=0;i < number_of_objects && ok;i++)
     {
       fscanf(file,"%s\n",type);
       printf("%s\n",type);
@@ -560,61 +4836,595 @@ int loadScene(char *argv)
 	{
 
 	  printf("found triangle\n");
-	  int j;
-
-	  for(j=0;j < 3;j++)
+	  if((ok = parse_triangle(file,&t)))
 	    {
-	      parse_doubles(file,"pos:",t.v[j].position);
-	      parse_doubles(file,"nor:",t.v[j].normal);
-	      parse_doubles(file,"dif:",t.v[j].color_diffuse);
-	      parse_doubles(file,"spe:",t.v[j].color_specular);
-	      parse_shi(file,&t.v[j].shininess);
+	      triangles.push_back(t);
+	      num_triangles++;
 	    }
-
-	  if(num_triangles == MAX_TRIANGLES)
+	}
+      else if(strcasecmp(type,"mesh")==0)
+	{
+	  printf("found mesh\n");
+	  if(!(ok = parse_name(file,mesh.name)))
+	    break;
+	  mesh.first = mesh_triangles.size();
+	  mesh.node = -1;
+	  mesh.root = -1;
+	  //either the triangles themselves or an obj or ply file and its material
+	  fscanf(file,"%s",str);
+	  if(strcasecmp(str,"file:")==0)
+	    {
+	      char name[1024];
+	      VertexMaterial material;
+	      fscanf(file,"%1023s",name);
+	      printf("file: %s\n",name);
+	      memset(material.normal,0,sizeof(material.normal));
+	      ok = parse_doubles(file,"dif:",material.color_diffuse) && parse_doubles(file,"spe:",material.color_specular) &&
+		parse_shi(file,&material.shininess) && import_mesh(argv,name,&material,mesh_triangles);
+	      mesh.count = mesh_triangles.size() - mesh.first;
+	    }
+	  else if((ok = parse_check("tri:",str)))
+	    {
+	      fscanf(file,"%i",&mesh.count);
+	      printf("tri: %i\n",mesh.count);
+	      for(int j = 0; j < mesh.count && ok; j++)
+		{
+		  fscanf(file,"%s",type);
+		  if((ok = parse_check("triangle",type) && parse_triangle(file,&t)))
+		    mesh_triangles.push_back(t);
+		}
+	    }
+	  meshes.push_back(mesh);
+	}
+      else if(strcasecmp(type,"instance")==0)
+	{
+	  char name[64] = "";
+	  printf("found instance\n");
+	  ok = parse_name(file,name);
+	  instance.mesh = -1;
+	  for(unsigned int j = 0; j < meshes.size(); j++)
+	    if(strcmp(meshes[j].name,name)==0)
+	      instance.mesh = j;
+	  if(ok && instance.mesh < 0)
 	    {
-	      printf("too many triangles, you should increase MAX_TRIANGLES!\n");
-	      exit(0);
+	      printf("instance of mesh %s before it is defined\n",name);
+	      ok = 0;
 	    }
-	  triangles[num_triangles++] = t;
+	  if(ok && (ok = parse_transform(file,&instance)))
+	    instances.push_back(instance);
 	}
       else if(strcasecmp(type,"sphere")==0)
 	{
 	  printf("found sphere\n");
 
-	  parse_doubles(file,"pos:",s.position);
-	  parse_rad(file,&s.radius);
-	  parse_doubles(file,"dif:",s.color_diffuse);
-	  parse_doubles(file,"spe:",s.color_specular);
-	  parse_shi(file,&s.shininess);
+	  ok = parse_doubles(file,"pos:",s.position) && parse_rad(file,&s.radius) &&
+	    parse_doubles(file,"dif:",s.color_diffuse) && parse_doubles(file,"spe:",s.color_specular) &&
+	    parse_shi(file,&s.shininess);
 
-	  if(num_spheres == MAX_SPHERES)
+	  if(ok && num_spheres == MAX_SPHERES)
 	    {
 	      printf("too many spheres, you should increase MAX_SPHERES!\n");
-	      exit(0);
+	      ok = 0;
 	    }
-	  spheres[num_spheres++] = s;
+	  if(ok)
+	    spheres[num_spheres++] = s;
 	}
       else if(strcasecmp(type,"light")==0)
 	{
 	  printf("found light\n");
-	  parse_doubles(file,"pos:",l.position);
-	  parse_doubles(file,"col:",l.color);
+	  ok = parse_doubles(file,"pos:",l.position) && parse_doubles(file,"col:",l.color);
 
-	  if(num_lights == MAX_LIGHTS)
+	  if(ok && num_lights == MAX_LIGHTS)
 	    {
 	      printf("too many lights, you should increase MAX_LIGHTS!\n");
-	      exit(0);
+	      ok = 0;
 	    }
-	  lights[num_lights++] = l;
+	  if(ok)
+	    lights[num_lights++] = l;
 	}
       else
 	{
 	  printf("unknown type in scene description:\n%s\n",type);
-	  exit(0);
+	  ok = 0;
+	}
+    }
+  fclose(file);
+  if(!ok)
+    return 0;
+  finish_scene(mesh_triangles);
+  return 1;
+}
+
+//puts the mesh triangles after the scene's own and reports the vertex sharing
+void finish_scene(std::vector<Triangle> &mesh_triangles)
+{
+  for(unsigned int i = 0; i < meshes.size(); i++)
+    meshes[i].first += num_triangles;
+  triangles.insert(triangles.end(), mesh_triangles.begin(), mesh_triangles.end());
+  std::unordered_map<Vertex, int, VertexHash, VertexEqual>().swap(vertex_lookup);
+  printf("vertices: %d shared by %d triangles, %.1f MB searched by rays and %.1f MB of materials, %.1f MB as separate copies\n",
+	 (int)vertex_materials.size(), (int)triangles.size(),
+	 (vertex_positions.size() * sizeof(real) + triangles.size() * sizeof(Triangle)) / 1048576.0,
+	 vertex_materials.size() * sizeof(VertexMaterial) / 1048576.0,
+	 triangles.size() * 3 * sizeof(Vertex) / 1048576.0);
+}
+
+//kinds of object in a scene file
+enum SceneObject {OBJECT_TRIANGLE, OBJECT_SPHERE, OBJECT_LIGHT, OBJECT_MESH, OBJECT_INSTANCE};
+
+//mesh as written in the scene. its triangles follow it as triangle objects,
+//or count is -1 and they come from an obj or ply file
+typedef struct _MeshHeader
+{
+  char name[64];
+  int count;
+  char file[1024];
+  VertexMaterial material;
+} MeshHeader;
+
+typedef struct _InstanceHeader
+{
+  char name[64];
+  Instance instance;
+} InstanceHeader;
+
+//what one loader thread read from its slice of the scene text, objects in file
+//order. vertices are deduplicated within the slice and triangles index them
+typedef struct _SceneChunk
+{
+  const char *next;
+  const char *end;
+  std::vector<char> objects;
+  std::vector<Vertex> vertices;
+  std::vector<Triangle> triangles;
+  std::vector<Sphere> spheres;
+  std::vector<Light> lights;
+  std::vector<MeshHeader> meshes;
+  std::vector<InstanceHeader> instances;
+  char error[256];
+} SceneChunk;
+
+//next whitespace separated word of the chunk, false at its end or after an error
+bool read_word(SceneChunk *chunk, char *word, int size)
+{
+  const char *p = chunk->next;
+  int length = 0;
+
+  while(p < chunk->end && isspace((unsigned char)*p))
+    p++;
+  if(p == chunk->end || chunk->error[0])
+    return false;
+  while(p < chunk->end && !isspace((unsigned char)*p))
+    {
+      if(length < size - 1)
+	word[length++] = *p;
+      p++;
+    }
+  word[length] = 0;
+  chunk->next = p;
+  return true;
+}
+
+//reads label followed by n numbers, as parse_doubles does
+bool read_reals(SceneChunk *chunk, const char *label, real *values, int n)
+{
+  char word[100] = "";
+
+  if(!read_word(chunk, word, sizeof(word)) || strcasecmp(word, label) != 0)
+    {
+      if(!chunk->error[0])
+	snprintf(chunk->error, sizeof(chunk->error), "Expected '%s ' found '%s '", label, word[0] ? word : "end of file");
+      return false;
+    }
+  for(int i = 0; i < n; i++)
+    {
+      char *end;
+      if(!read_word(chunk, word, sizeof(word)))
+	return false;
+      values[i] = strtod(word, &end);
+      if(end == word)
+	{
+	  snprintf(chunk->error, sizeof(chunk->error), "Expected a number after '%s ' found '%s '", label, word);
+	  return false;
+	}
+    }
+  return true;
+}
+
+bool read_text(SceneChunk *chunk, const char *label, char *text, int size)
+{
+  char word[100] = "";
+
+  if(!read_word(chunk, word, sizeof(word)) || strcasecmp(word, label) != 0 || !read_word(chunk, text, size))
+    {
+      if(!chunk->error[0])
+	snprintf(chunk->error, sizeof(chunk->error), "Expected '%s ' found '%s '", label, word[0] ? word : "end of file");
+      return false;
+    }
+  return true;
+}
+
+//parses every object in the chunk
+void parse_chunk(SceneChunk *chunk)
+{
+  std::unordered_map<Vertex, int, VertexHash, VertexEqual> lookup;
+  char type[100];
+
+  while(read_word(chunk, type, sizeof(type)))
+    {
+      if(strcasecmp(type, "triangle") == 0)
+	{
+	  Triangle t;
+	  Vertex v;
+	  for(int j = 0; j < 3; j++)
+	    {
+	      if(!read_reals(chunk, "pos:", v.position, 3) || !read_reals(chunk, "nor:", v.normal, 3) ||
+		 !read_reals(chunk, "dif:", v.color_diffuse, 3) || !read_reals(chunk, "spe:", v.color_specular, 3) ||
+		 !read_reals(chunk, "shi:", &v.shininess, 1))
+		return;
+	      std::pair<std::unordered_map<Vertex, int, VertexHash, VertexEqual>::iterator, bool> found =
+		lookup.insert(std::make_pair(v, (int)chunk->vertices.size()));
+	      if(found.second)
+		chunk->vertices.push_back(v);
+	      t.v[j] = found.first->second;
+	    }
+	  chunk->triangles.push_back(t);
+	  chunk->objects.push_back(OBJECT_TRIANGLE);
+	}
+      else if(strcasecmp(type, "sphere") == 0)
+	{
+	  Sphere sphere;
+	  if(!read_reals(chunk, "pos:", sphere.position, 3) || !read_reals(chunk, "rad:", &sphere.radius, 1) ||
+	     !read_reals(chunk, "dif:", sphere.color_diffuse, 3) || !read_reals(chunk, "spe:", sphere.color_specular, 3) ||
+	     !read_reals(chunk, "shi:", &sphere.shininess, 1))
+	    return;
+	  chunk->spheres.push_back(sphere);
+	  chunk->objects.push_back(OBJECT_SPHERE);
+	}
+      else if(strcasecmp(type, "light") == 0)
+	{
+	  Light light;
+	  if(!read_reals(chunk, "pos:", light.position, 3) || !read_reals(chunk, "col:", light.color, 3))
+	    return;
+	  chunk->lights.push_back(light);
+	  chunk->objects.push_back(OBJECT_LIGHT);
+	}
+      else if(strcasecmp(type, "mesh") == 0)
+	{
+	  MeshHeader mesh;
+	  char word[100] = "";
+	  if(!read_text(chunk, "name:", mesh.name, sizeof(mesh.name)) || !read_word(chunk, word, sizeof(word)))
+	    return;
+	  if(strcasecmp(word, "file:") == 0)
+	    {
+	      mesh.count = -1;
+	      memset(mesh.material.normal, 0, sizeof(mesh.material.normal));
+	      if(!read_word(chunk, mesh.file, sizeof(mesh.file)) || !read_reals(chunk, "dif:", mesh.material.color_diffuse, 3) ||
+		 !read_reals(chunk, "spe:", mesh.material.color_specular, 3) || !read_reals(chunk, "shi:", &mesh.material.shininess, 1))
+		return;
+	    }
+	  else if(strcasecmp(word, "tri:") == 0 && read_word(chunk, word, sizeof(word)))
+	    mesh.count = atoi(word);
+	  else
+	    {
+	      snprintf(chunk->error, sizeof(chunk->error), "Expected 'tri: ' or 'file: ' found '%s '", word);
+	      return;
+	    }
+	  chunk->meshes.push_back(mesh);
+	  chunk->objects.push_back(OBJECT_MESH);
+	}
+      else if(strcasecmp(type, "instance") == 0)
+	{
+	  InstanceHeader instance;
+	  real position[3], rotation[3], scale[3];
+	  if(!read_text(chunk, "name:", instance.name, sizeof(instance.name)) || !read_reals(chunk, "pos:", position, 3) ||
+	     !read_reals(chunk, "rot:", rotation, 3) || !read_reals(chunk, "sca:", scale, 3))
+	    return;
+	  if(!set_transform(&instance.instance, position, rotation, scale))
+	    {
+	      snprintf(chunk->error, sizeof(chunk->error), "instance scale can't be zero");
+	      return;
+	    }
+	  chunk->instances.push_back(instance);
+	  chunk->objects.push_back(OBJECT_INSTANCE);
+	}
+      else
+	{
+	  snprintf(chunk->error, sizeof(chunk->error), "unknown type in scene description: %s", type);
+	  return;
+	}
+    }
+}
+
+//start of the first line at or after p that begins an object, so slices of the
+//file never cut one in half. a triangle of a mesh may start a slice, the merge
+//gives it back to its mesh
+const char *object_start(const char *p, const char *begin, const char *end)
+{
+  static const char *keywords[] = {"triangle", "sphere", "light", "mesh", "instance"};
+
+  while(p < end)
+    {
+      if(p > begin && p[-1] != '\n')
+	{
+	  p = (const char *)memchr(p, '\n', end - p);
+	  if(!p)
+	    return end;
+	  p++;
+	  continue;
+	}
+      for(int i = 0; i < 5; i++)
+	{
+	  size_t length = strlen(keywords[i]);
+	  if((size_t)(end - p) > length && strncasecmp(p, keywords[i], length) == 0 && isspace((unsigned char)p[length]))
+	    return p;
+	}
+      p++;
+    }
+  return end;
+}
+
+//slice vertices named by their place in all the slices' vertices one after another,
+//hashed and compared through the vertices and hashes the merge already has
+struct MergedVertexHash
+{
+  const uint64_t *hashes;
+  MergedVertexHash(const uint64_t *h) : hashes(h) {}
+  size_t operator()(int i) const { return hashes[i]; }
+};
+
+struct MergedVertexEqual
+{
+  const Vertex *const *vertices;
+  MergedVertexEqual(const Vertex *const *v) : vertices(v) {}
+  bool operator()(int a, int b) const { return memcmp(vertices[a], vertices[b], sizeof(Vertex)) == 0; }
+};
+
+//adds the slices' vertices to the scene in file order, each once, as add_vertex
+//would, and points the slices' triangles at them. the top bits of a vertex's hash
+//pick its partition, so equal vertices meet in the same one and every partition
+//is deduplicated on a thread of its own, hashing each vertex once
+void merge_vertices(std::vector<SceneChunk> &chunks)
+{
+  const int partitions = 1 << VERTEX_PARTITION_BITS;
+  int slices = chunks.size();
+  std::vector<int> first(slices + 1, 0);
+  for(int c = 0; c < slices; c++)
+    first[c + 1] = first[c] + chunks[c].vertices.size();
+  int total = first[slices];
+  std::vector<const Vertex *> vertices(total);
+  std::vector<uint64_t> hashes(total);
+  std::vector<std::vector<int> > members(slices * partitions);
+  
+  parallel_for(slices, [&](int begin, int end)
+  {
+    VertexHash hash;
+    for(int c = begin; c < end; c++)
+      for(int i = first[c]; i < first[c + 1]; i++)
+	{
+	  vertices[i] = &chunks[c].vertices[i - first[c]];
+	  hashes[i] = hash(*vertices[i]);
+	  members[c * partitions + (hashes[i] >> (64 - VERTEX_PARTITION_BITS))].push_back(i);
+	}
+  });
+  
+  //each vertex points at the first one equal to it, slices are walked in file order
+  std::vector<int> owner(total);
+  parallel_for(partitions, [&](int begin, int end)
+  {
+    for(int p = begin; p < end; p++)
+      {
+	std::unordered_set<int, MergedVertexHash, MergedVertexEqual> seen(0, MergedVertexHash(&hashes[0]), MergedVertexEqual(&vertices[0]));
+	for(int c = 0; c < slices; c++)
+	  {
+	    std::vector<int> &member = members[c * partitions + p];
+	    for(unsigned int i = 0; i < member.size(); i++)
+	      owner[member[i]] = *seen.insert(member[i]).first;
+	  }
+      }
+  });
+  
+  //first sightings become scene vertices, numbered in file order
+  std::vector<int> added(slices + 1, 0);
+  parallel_for(slices, [&](int begin, int end)
+  {
+    for(int c = begin; c < end; c++)
+      for(int i = first[c]; i < first[c + 1]; i++)
+	added[c + 1] += owner[i] == i;
+  });
+  for(int c = 0; c < slices; c++)
+    added[c + 1] += added[c];
+  int base = vertex_materials.size();
+  vertex_positions.resize(3 * (base + added[slices]));
+  vertex_materials.resize(base + added[slices]);
+  std::vector<int> remap(total);
+  parallel_for(slices, [&](int begin, int end)
+  {
+    for(int c = begin; c < end; c++)
+      {
+	int next = base + added[c];
+	for(int i = first[c]; i < first[c + 1]; i++)
+	  if(owner[i] == i)
+	    {
+	      memcpy(&vertex_positions[3 * next], vertices[i]->position, 3 * sizeof(real));
+	      vertex_materials[next] = vertex_material(*vertices[i]);
+	      remap[i] = next++;
+	    }
+      }
+  });
+  //repeats take the index of the vertex they repeat, which may be in an earlier slice
+  parallel_for(slices, [&](int begin, int end)
+  {
+    for(int c = begin; c < end; c++)
+      {
+	for(int i = first[c]; i < first[c + 1]; i++)
+	  remap[i] = remap[owner[i]];
+	for(unsigned int i = 0; i < chunks[c].triangles.size(); i++)
+	  for(int j = 0; j < 3; j++)
+	    chunks[c].triangles[i].v[j] = remap[first[c] + chunks[c].triangles[i].v[j]];
+      }
+  });
+}
+
+//parses the scene file in slices on num_threads threads, then merges them in
+//file order into the same arrays loadScene fills, without echoing every value.
+//0 after printing what was wrong if it can't be read
+int load_scene_parallel(char *name)
+{
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  struct stat info;
+  int fd = open(name, O_RDONLY);
+
+  if(fd < 0 || fstat(fd, &info) != 0 || info.st_size == 0)
+    {
+      printf("can't read scene file %s\n", name);
+      if(fd >= 0)
+	close(fd);
+      return 0;
+    }
+  const char *data = (const char *)mmap(0, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(data == MAP_FAILED)
+    {
+      printf("can't map scene file %s\n", name);
+      return 0;
+    }
+  const char *end = data + info.st_size;
+
+  //object count and ambient light come first
+  SceneChunk header;
+  char word[100];
+  int number_of_objects;
+  header.next = data;
+  header.end = end;
+  header.error[0] = 0;
+  if(!read_word(&header, word, sizeof(word)) || !read_reals(&header, "amb:", ambient_light, 3))
+    {
+      printf("Parse error, abnormal abortion\n");
+      munmap((void *)data, info.st_size);
+      return 0;
+    }
+  number_of_objects = atoi(word);
+
+  //slices start at object lines, at least 64k each
+  int slices = std::max(1, std::min(num_threads, (int)((end - header.next) >> 16)));
+  std::vector<SceneChunk> chunks(slices);
+  const char *p = header.next;
+  for(int i = 0; i < slices; i++)
+    {
+      chunks[i].next = p;
+      chunks[i].end = i == slices - 1 ? end : object_start(header.next + (end - header.next) * (i + 1) / slices, data, end);
+      chunks[i].error[0] = 0;
+      p = chunks[i].end;
+    }
+  parallel_for(slices, [&](int begin, int last)
+  {
+    for(int i = begin; i < last; i++)
+      parse_chunk(&chunks[i]);
+  });
+  munmap((void *)data, info.st_size);
+  double parsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  //merge in file order. mesh triangles go after the scene's own once everything is read
+  std::vector<Triangle> mesh_triangles;
+  int objects = 0, meshRemaining = 0;
+  merge_vertices(chunks);
+  for(int c = 0; c < slices && (objects < number_of_objects || meshRemaining > 0); c++)
+    {
+      SceneChunk *chunk = &chunks[c];
+      int next[5] = {0, 0, 0, 0, 0};
+      for(unsigned int i = 0; i < chunk->objects.size() && (objects < number_of_objects || meshRemaining > 0); i++)
+	{
+	  int type = chunk->objects[i];
+	  int index = next[type]++;
+	  if(type == OBJECT_TRIANGLE)
+	    {
+	      Triangle t = chunk->triangles[index];
+	      if(meshRemaining > 0)
+		{
+		  mesh_triangles.push_back(t);
+		  meshRemaining--;
+		  continue;
+		}
+	      triangles.push_back(t);
+	      num_triangles++;
+	    }
+	  else if(type == OBJECT_SPHERE)
+	    {
+	      if(num_spheres == MAX_SPHERES)
+		{
+		  printf("too many spheres, you should increase MAX_SPHERES!\n");
+		  return 0;
+		}
+	      spheres[num_spheres++] = chunk->spheres[index];
+	    }
+	  else if(type == OBJECT_LIGHT)
+	    {
+	      if(num_lights == MAX_LIGHTS)
+		{
+		  printf("too many lights, you should increase MAX_LIGHTS!\n");
+		  return 0;
+		}
+	      lights[num_lights++] = chunk->lights[index];
+	    }
+	  else if(type == OBJECT_MESH)
+	    {
+	      MeshHeader *definition = &chunk->meshes[index];
+	      Mesh mesh;
+	      if(meshRemaining > 0)
+		{
+		  printf("Expected 'triangle ' found 'mesh ', %s is missing %d triangles\n", meshes.back().name, meshRemaining);
+		  printf("Parse error, abnormal abortion\n");
+		  return 0;
+		}
+	      strcpy(mesh.name, definition->name);
+	      mesh.first = mesh_triangles.size();
+	      mesh.node = -1;
+	      mesh.root = -1;
+	      if(definition->count < 0)
+		{
+		  if(!import_mesh(name, definition->file, &definition->material, mesh_triangles))
+		    return 0;
+		  mesh.count = mesh_triangles.size() - mesh.first;
+		}
+	      else
+		mesh.count = meshRemaining = definition->count;
+	      meshes.push_back(mesh);
+	    }
+	  else
+	    {
+	      InstanceHeader *placement = &chunk->instances[index];
+	      placement->instance.mesh = -1;
+	      for(unsigned int j = 0; j < meshes.size(); j++)
+		if(strcmp(meshes[j].name, placement->name) == 0)
+		  placement->instance.mesh = j;
+	      if(placement->instance.mesh < 0)
+		{
+		  printf("instance of mesh %s before it is defined\n", placement->name);
+		  return 0;
+		}
+	      instances.push_back(placement->instance);
+	    }
+	  objects++;
 	}
+      //an error only counts if the objects before it weren't all there was to read
+      if(chunk->error[0] && (objects < number_of_objects || meshRemaining > 0))
+	{
+	  printf("%s\n", chunk->error);
+	  printf("Parse error, abnormal abortion\n");
+	  return 0;
+	}
+    }
+  if(objects < number_of_objects || meshRemaining > 0)
+    {
+      printf("scene file %s ends after %d of its %d objects\n", name, objects, number_of_objects);
+      return 0;
     }
-  return 0;
+  finish_scene(mesh_triangles);
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  printf("parsed %s: %d objects, %.1f MB in %d slices on %d threads, %.2f s (%.2f s merging)\n", name, objects,
+	 info.st_size / 1048576.0, slices, std::min(slices, num_threads), seconds, seconds - parsed);
+  return 1;
 }
 
 void display()
@@ -633,37 +5443,569 @@ void init()
   glClear(GL_COLOR_BUFFER_BIT);
 }
 
+//restats a watched file, true when its size or modification time moved. a file
+//that can't be read has size -1
+bool restat_file(WatchedFile *file)
+{
+  struct stat info;
+  time_t mtime = 0;
+  off_t size = -1;
+  
+  if(stat(file->path, &info) == 0)
+  {
+    mtime = info.st_mtime;
+    size = info.st_size;
+  }
+  bool moved = mtime != file->mtime || size != file->size;
+  file->mtime = mtime;
+  file->size = size;
+  return moved;
+}
+
+//notes the scene file, hashed before it was read, and the mesh files it imports.
+//on linux inotify reports writes to the directories holding them
+void watch_files(uint64_t scene_hash)
+{
+  WatchedFile file;
+  
+  watched_files.clear();
+  snprintf(file.path, sizeof(file.path), "%s", scene_file);
+  file.hash = scene_hash;
+  watched_files.push_back(file);
+  for(unsigned int i = 0; i < imported_files.size(); i++)
+  {
+    snprintf(file.path, sizeof(file.path), "%s", imported_files[i].path);
+    file.hash = imported_files[i].hash;
+    watched_files.push_back(file);
+  }
+  for(unsigned int i = 0; i < watched_files.size(); i++)
+  {
+    watched_files[i].mtime = 0;
+    watched_files[i].size = -1;
+    restat_file(&watched_files[i]);
+  }
+  
+#ifdef __linux__
+  //a new descriptor drops the watches on directories the scene no longer uses.
+  //editors often save by renaming a new file over the old one, so watch for that too
+  if(watch_fd >= 0)
+    close(watch_fd);
+  watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  for(unsigned int i = 0; i < watched_files.size() && watch_fd >= 0; i++)
+  {
+    char directory[1024];
+    snprintf(directory, sizeof(directory), "%s", watched_files[i].path);
+    char *slash = strrchr(directory, '/');
+    if(!slash)
+      strcpy(directory, ".");
+    else
+      slash[slash == directory ? 1 : 0] = '\0';
+    if(inotify_add_watch(watch_fd, directory, IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) < 0)
+    {
+      perror(directory);
+      close(watch_fd);
+      watch_fd = -1;
+    }
+  }
+#endif
+}
+
+//true once the scene file or a mesh file it imports holds something other than
+//what was loaded. waits up to WATCH_INTERVAL for inotify to report a write to one,
+//or without inotify sleeps that long and compares their sizes and times
+bool scene_changed()
+{
+  bool touched = false;
+  
+#ifdef __linux__
+  if(watch_fd >= 0)
+  {
+    struct pollfd waiting = {watch_fd, POLLIN, 0};
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t length;
+    
+    if(poll(&waiting, 1, WATCH_INTERVAL) <= 0)
+      return false;
+    while((length = read(watch_fd, events, sizeof(events))) > 0)
+      for(char *p = events; p < events + length; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len)
+      {
+        struct inotify_event *event = (struct inotify_event *)p;
+        for(unsigned int i = 0; i < watched_files.size() && event->len > 0; i++)
+        {
+          const char *base = strrchr(watched_files[i].path, '/');
+          if(strcmp(event->name, base ? base + 1 : watched_files[i].path) == 0)
+            touched = true;
+        }
+      }
+  }
+  else
+#endif
+  {
+    usleep(WATCH_INTERVAL * 1000);
+    for(unsigned int i = 0; i < watched_files.size(); i++)
+      if(restat_file(&watched_files[i]))
+        touched = true;
+  }
+  if(!touched)
+    return false;
+  
+  //let whatever is writing the files finish before they are read
+  bool settling = true;
+  while(settling)
+  {
+    usleep(WATCH_SETTLE * 1000);
+    settling = false;
+    for(unsigned int i = 0; i < watched_files.size(); i++)
+      if(restat_file(&watched_files[i]))
+        settling = true;
+  }
+  //a file that is gone may be coming back, and one saved unchanged needs no render
+  bool changed = false;
+  for(unsigned int i = 0; i < watched_files.size(); i++)
+  {
+    if(watched_files[i].size < 0)
+      return false;
+    if(hash_file(watched_files[i].path) != watched_files[i].hash)
+      changed = true;
+  }
+  return changed;
+}
+
+//reads the changed scene in place of the loaded one, which is only dropped once the
+//new one has parsed. a scene that can't be read leaves the old one as it was and
+//returns false. when every triangle still has the same corners the old bvh is
+//kept, and refit if any of them moved, instead of being rebuilt. a refit that
+//leaves it past refit_limit rebuilds it after all
+bool reload_scene()
+{
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  uint64_t scene_hash = hash_file(scene_file);
+  
+  //set the loaded scene aside while the new one is read
+  SceneVector<Triangle> old_triangles;
+  SceneVector<real> old_positions;
+  SceneVector<VertexMaterial> old_materials;
+  SceneVector<Mesh> old_meshes;
+  SceneVector<Instance> old_instances;
+  SceneVector<ImportedFile> old_imports;
+  SceneVector<BVHNode> old_nodes;
+  SceneVector<int> old_order;
+  old_triangles.swap(triangles);
+  old_positions.swap(vertex_positions);
+  old_materials.swap(vertex_materials);
+  old_meshes.swap(meshes);
+  old_instances.swap(instances);
+  old_imports.swap(imported_files);
+  old_nodes.swap(bvh_nodes);
+  old_order.swap(bvh_order);
+  std::vector<Sphere> old_spheres(spheres, spheres + num_spheres);
+  std::vector<Light> old_lights(lights, lights + num_lights);
+  real old_ambient[3] = {ambient_light[0], ambient_light[1], ambient_light[2]};
+  int old_root = bvh_root;
+  double old_cost = bvh_cost;
+  int old_scene_triangles = num_triangles;
+  num_triangles = 0;
+  num_spheres = 0;
+  num_lights = 0;
+  //the new scene starts a block of its own, so the old one's blocks are freed
+  //as soon as it lets go of them
+  arena_current = -1;
+  
+  printf("%s changed, reloading\n", scene_file);
+  int loaded;
+  if(serial_parse)
+    loaded = loadScene(scene_file);
+  else
+    loaded = load_scene_parallel(scene_file);
+  if(!loaded)
+  {
+    //what was read of the new scene goes with the arrays swapped out here
+    triangles.swap(old_triangles);
+    vertex_positions.swap(old_positions);
+    vertex_materials.swap(old_materials);
+    meshes.swap(old_meshes);
+    instances.swap(old_instances);
+    imported_files.swap(old_imports);
+    bvh_nodes.swap(old_nodes);
+    bvh_order.swap(old_order);
+    std::copy(old_spheres.begin(), old_spheres.end(), spheres);
+    std::copy(old_lights.begin(), old_lights.end(), lights);
+    memcpy(ambient_light, old_ambient, sizeof(ambient_light));
+    num_triangles = old_scene_triangles;
+    num_spheres = old_spheres.size();
+    num_lights = old_lights.size();
+    std::unordered_map<Vertex, int, VertexHash, VertexEqual>().swap(vertex_lookup);
+    printf("%s can't be loaded, keeping the scene as it was until it changes again\n", scene_file);
+    fflush(stdout);
+    return false;
+  }
+  //the trees over the old scene are rebuilt below, let go of their blocks with it
+  SceneVector<WideNode>().swap(wide_nodes);
+  SceneVector<QuantizedNode8>().swap(quantized8_nodes);
+  SceneVector<QuantizedNode16>().swap(quantized16_nodes);
+  SceneVector<BVHNode>().swap(instance_nodes);
+  SceneVector<int>().swap(instance_order);
+  
+  //the same triangles over the same vertices, in the same meshes
+  bool same_shape = num_triangles == old_scene_triangles && triangles.size() == old_triangles.size() &&
+                    vertex_positions.size() == old_positions.size() && meshes.size() == old_meshes.size();
+  for(unsigned int i = 0; i < triangles.size() && same_shape; i++)
+    same_shape = memcmp(&triangles[i], &old_triangles[i], sizeof(Triangle)) == 0;
+  for(unsigned int i = 0; i < meshes.size() && same_shape; i++)
+    same_shape = meshes[i].first == old_meshes[i].first && meshes[i].count == old_meshes[i].count;
+  
+  int moved = 0, recolored = 0;
+  if(same_shape)
+  {
+    for(unsigned int i = 0; i < triangles.size(); i++)
+    {
+      bool corner_moved = false, corner_recolored = false;
+      for(int c = 0; c < 3; c++)
+      {
+        int v = triangles[i].v[c];
+        if(memcmp(&vertex_positions[3 * v], &old_positions[3 * v], 3 * sizeof(real)) != 0)
+          corner_moved = true;
+        if(memcmp(&vertex_materials[v], &old_materials[v], sizeof(VertexMaterial)) != 0)
+          corner_recolored = true;
+      }
+      moved += corner_moved;
+      recolored += corner_recolored;
+    }
+  }
+  int changed_spheres = std::abs(num_spheres - (int)old_spheres.size());
+  for(int i = 0; i < std::min(num_spheres, (int)old_spheres.size()); i++)
+    changed_spheres += memcmp(&spheres[i], &old_spheres[i], sizeof(Sphere)) != 0;
+  int changed_lights = std::abs(num_lights - (int)old_lights.size());
+  for(int i = 0; i < std::min(num_lights, (int)old_lights.size()); i++)
+    changed_lights += memcmp(&lights[i], &old_lights[i], sizeof(Light)) != 0;
+  int changed_instances = std::abs((int)instances.size() - (int)old_instances.size());
+  for(unsigned int i = 0; i < std::min(instances.size(), old_instances.size()); i++)
+    changed_instances += instances[i].mesh != old_instances[i].mesh ||
+                         memcmp(instances[i].transform, old_instances[i].transform, sizeof(instances[i].transform)) != 0;
+  
+  std::chrono::steady_clock::time_point bvh_start = std::chrono::steady_clock::now();
+  double growth = 0;
+  if(same_shape)
+  {
+    bvh_nodes.swap(old_nodes);
+    bvh_order.swap(old_order);
+    bvh_root = old_root;
+    bvh_cost = old_cost;
+    for(unsigned int i = 0; i < meshes.size(); i++)
+    {
+      meshes[i].node = old_meshes[i].node;
+      meshes[i].cost = old_meshes[i].cost;
+    }
+    if(moved > 0)
+      growth = refit_bvhs();
+    //the refit boxes can only grow as far as the vertices moved, past the limit a
+    //new tree pays for itself
+    if(growth > refit_limit)
+      build_bvh();
+  }
+  else
+    build_bvh();
+  double bvh_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - bvh_start).count();
+  if(cache_file)
+    write_scene_cache(scene_hash);
+  build_wide_bvh();
+  build_instances();
+  
+  for(int i = 0; i < num_lights; i++)
+    light_tree_order[i] = i;
+  if(num_lights > 0)
+    build_light_tree(0, num_lights);
+  find_scene_bounds();
+  scene_file_hash = scene_hash;
+  watch_files(scene_hash);
+  
+  if(same_shape && moved == 0)
+    printf("reload: %d of %d triangles recolored, bvh kept\n", recolored, (int)triangles.size());
+  else if(same_shape)
+    printf("reload: %d of %d triangles moved and %d recolored, bvh refit to %.2f times its sah cost when built%s in %.1f ms\n",
+           moved, (int)triangles.size(), recolored, growth, growth > refit_limit ? " and rebuilt" : "", bvh_seconds * 1000);
+  else
+    printf("reload: triangles or vertices added or removed, bvh rebuilt in %.1f ms\n", bvh_seconds * 1000);
+  printf("reload: %d spheres, %d lights and %d instances changed, %.1f ms in all\n", changed_spheres, changed_lights, changed_instances,
+         std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() * 1000);
+  fflush(stdout);
+  return true;
+}
+
+//clears the image and the counters to render a reloaded scene from the first pass,
+//forking new workers so they have it too. glut is up by now, the workers close
+//the display connection they inherit and never touch glut
+void restart_render()
+{
+  passes_done = 0;
+  memset(row_passes, 0, sizeof(row_passes));
+  memset(accumulation, 0, sizeof(accumulation));
+  memset(accumulation_sq, 0, sizeof(accumulation_sq));
+  memset(sample_counts, 0, sizeof(sample_counts));
+  memset(pixel_active, 1, sizeof(pixel_active));
+  total_rays_traced = 0;
+  shadow_cache_lookups = 0;
+  shadow_cache_hits = 0;
+  sorted_ray_pairs = 0;
+  coherent_pairs_before = 0;
+  coherent_pairs_after = 0;
+  //the main thread's cache points into the old scene
+  memset(&shadow_cache, 0, sizeof(shadow_cache));
+  if(!worker_processes.empty())
+  {
+    num_workers = worker_processes.size();
+    worker_processes.clear();
+    start_workers();
+  }
+}
+
 void idle()
 {
-  //hack to make it only draw once
-  static int once=0;
-  if(!once)
+  static int finished = 0;
+  static int started = 0;
+  if(finished)
+  {
+    //with -watch a changed scene is loaded and rendered again, one that can't be
+    //loaded leaves the last image up until the next change
+    if(!watch_scene || !scene_changed() || !reload_scene())
+      return;
+    restart_render();
+    finished = 0;
+    started = 0;
+    return;
+  }
+
+  //refine the image a pass at a time until every pixel has its samples
+  if(passes_done < samples_per_pixel)
   {
-      draw_scene();
-      if(mode == MODE_JPEG)
-	save_jpg();
+    if(!started)
+    {
+      render_start = std::chrono::steady_clock::now();
+      deadline = render_start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(time_budget));
+      started = 1;
     }
-  once=1;
+    draw_scene();
+    tone_map();
+    show_buffer();
+    if(time_budget > 0)
+      printf("pass %d, %.2f s left\n", passes_done, std::max(0.0, std::chrono::duration<double>(deadline - std::chrono::steady_clock::now()).count()));
+    else if(samples_per_pixel > 1)
+      printf("pass %d of %d\n", passes_done, samples_per_pixel);
+    if(passes_done < samples_per_pixel && !out_of_time())
+      return;
+    printf("Done!\n");
+    report_stats(std::chrono::duration<double>(std::chrono::steady_clock::now() - render_start).count());
+    if(time_budget > 0)
+      report_samples();
+    //keep the finished state so a later run can resume with more samples
+    if(checkpoint_file)
+      write_checkpoint();
+    stop_workers();
+  }
+  else
+  {
+    //a loaded hdr image only needs tone mapping
+    tone_map();
+    show_buffer();
+  }
+  finished = 1;
+  if(mode == MODE_JPEG)
+    save_image();
+}
+
+void usage(char *program)
+{
+  printf ("usage: %s [options] <scenefile|.pfm|.hdr> [jpegname|.pfm|.hdr]\n", program);
+  printf ("  -lightsamples <n>   lights sampled per shading point (default %d)\n", LIGHT_SAMPLES);
+  printf ("  -alllights          shade with every light instead of sampling\n");
+  printf ("  -path               path trace with indirect light instead of phong shading\n");
+  printf ("  -spp <n>            samples per pixel (default 1, or %d when path tracing)\n", PATH_SAMPLES);
+  printf ("  -depth <n>          longest path in bounces (default %d)\n", PATH_DEPTH);
+  printf ("  -threads <n>        rendering and scene loading threads (default one per core)\n");
+  printf ("  -exposure <e>       scale applied before tone mapping (default 1)\n");
+  printf ("  -gamma <g>          display gamma (default 1, linear)\n");
+  printf ("  -reinhard           compress highlights instead of clamping them\n");
+  printf ("  -crop <l> <t> <r> <b> render only pixels l..r-1 across and t..b-1 down, saved as a cropped image\n");
+  printf ("  -patch              with -crop, write the pixels into the full image already saved as the output\n");
+  printf ("  -budget <s>         render until s seconds have passed, sampling noisy pixels most\n");
+  printf ("  -wavefront          with -path, trace batches of rows a bounce at a time\n");
+  printf ("  -bvh <sah|lbvh|none> triangle bvh builder (default sah)\n");
+  printf ("  -bvhnodes <full|16|8> bits per child box plane in the bvh nodes (default full)\n");
+  printf ("  -serialparse        read the scene on one thread, printing every value as it is read\n");
+  printf ("  -cache <file>       keep the parsed scene and its bvh in file, reused while the scene file is unchanged\n");
+  printf ("  -watch              after rendering, reload the scene and render again whenever it or a mesh file it imports changes\n");
+  printf ("  -refitlimit <r>     with -watch, rebuild a bvh refit to moved vertices once its sah cost grows r times (default %g)\n", REFIT_LIMIT);
+  printf ("  -sortrays           with -wavefront, sort secondary rays by direction and origin before tracing\n");
+  printf ("  -workers <n>        render in n worker processes, -threads then counts threads per worker\n");
+  printf ("  -workertimeout <s>  seconds a worker may keep a tile before it goes to another (default %d times the mean tile time, at least %d)\n",
+          WORKER_TIMEOUT_TILES, WORKER_TIMEOUT);
+  printf ("  -checkpoint <file>  save progress to file while rendering\n");
+  printf ("  -interval <s>       seconds between checkpoints (default %d)\n", CHECKPOINT_INTERVAL);
+  printf ("  -resume             continue from the checkpoint file if there is one\n");
+  exit(0);
 }
 
 int main (int argc, char ** argv)
 {
-  if (argc<2 || argc > 3)
-  {  
-    printf ("usage: %s <scenefile> [jpegname]\n", argv[0]);
-    exit(0);
+  char *args[2];
+  int num_args = 0;
+
+  //pull the options out, leaving the scene file and jpeg name
+  for(int i = 1; i < argc; i++)
+  {
+    if(strcmp(argv[i], "-lightsamples") == 0 && i + 1 < argc)
+      light_samples = atoi(argv[++i]);
+    else if(strcmp(argv[i], "-alllights") == 0)
+      light_samples = 0;
+    else if(strcmp(argv[i], "-path") == 0)
+      render_mode = RENDER_PATH;
+    else if(strcmp(argv[i], "-spp") == 0 && i + 1 < argc)
+      samples_per_pixel = atoi(argv[++i]);
+    else if(strcmp(argv[i], "-depth") == 0 && i + 1 < argc)
+      max_depth = atoi(argv[++i]);
+    else if(strcmp(argv[i], "-threads") == 0 && i + 1 < argc)
+      num_threads = atoi(argv[++i]);
+    else if(strcmp(argv[i], "-exposure") == 0 && i + 1 < argc)
+      exposure = atof(argv[++i]);
+    else if(strcmp(argv[i], "-gamma") == 0 && i + 1 < argc)
+      display_gamma = atof(argv[++i]);
+    else if(strcmp(argv[i], "-reinhard") == 0)
+      tone_operator = TONE_REINHARD;
+    else if(strcmp(argv[i], "-crop") == 0 && i + 4 < argc)
+    {
+      crop_left = atoi(argv[++i]);
+      crop_top = atoi(argv[++i]);
+      crop_right = atoi(argv[++i]);
+      crop_bottom = atoi(argv[++i]);
+    }
+    else if(strcmp(argv[i], "-patch") == 0)
+      patch_output = 1;
+    else if(strcmp(argv[i], "-budget") == 0 && i + 1 < argc)
+      time_budget = atof(argv[++i]);
+    else if(strcmp(argv[i], "-wavefront") == 0)
+      wavefront = 1;
+    else if(strcmp(argv[i], "-serialparse") == 0)
+      serial_parse = true;
+    else if(strcmp(argv[i], "-bvh") == 0 && i + 1 < argc)
+    {
+      i++;
+      if(strcmp(argv[i], "sah") == 0)
+        bvh_builder = BVH_SAH;
+      else if(strcmp(argv[i], "lbvh") == 0)
+        bvh_builder = BVH_LBVH;
+      else if(strcmp(argv[i], "none") == 0)
+        bvh_builder = BVH_NONE;
+      else
+        usage(argv[0]);
+    }
+    else if(strcmp(argv[i], "-bvhnodes") == 0 && i + 1 < argc)
+    {
+      i++;
+      if(strcmp(argv[i], "full") == 0)
+        bvh_node_bits = 0;
+      else if(strcmp(argv[i], "16") == 0 || strcmp(argv[i], "8") == 0)
+        bvh_node_bits = atoi(argv[i]);
+      else
+        usage(argv[0]);
+    }
+    else if(strcmp(argv[i], "-cache") == 0 && i + 1 < argc)
+      cache_file = argv[++i];
+    else if(strcmp(argv[i], "-watch") == 0)
+      watch_scene = true;
+    else if(strcmp(argv[i], "-refitlimit") == 0 && i + 1 < argc)
+      refit_limit = atof(argv[++i]);
+    else if(strcmp(argv[i], "-sortrays") == 0)
+      sort_rays = 1;
+    else if(strcmp(argv[i], "-workers") == 0 && i + 1 < argc)
+      num_workers = atoi(argv[++i]);
+    else if(strcmp(argv[i], "-workertimeout") == 0 && i + 1 < argc)
+      worker_timeout = atof(argv[++i]);
+    else if(strcmp(argv[i], "-checkpoint") == 0 && i + 1 < argc)
+      checkpoint_file = argv[++i];
+    else if(strcmp(argv[i], "-interval") == 0 && i + 1 < argc)
+      checkpoint_interval = atof(argv[++i]);
+    else if(strcmp(argv[i], "-resume") == 0)
+      resume = 1;
+    else if(argv[i][0] == '-' || num_args == 2)
+      usage(argv[0]);
+    else
+      args[num_args++] = argv[i];
+  }
+  if (num_args < 1 || (resume && !checkpoint_file))
+    usage(argv[0]);
+  if(crop_left < 0 || crop_top < 0 || crop_right > WIDTH || crop_bottom > HEIGHT || crop_left >= crop_right || crop_top >= crop_bottom)
+  {
+    printf("crop must lie inside the %dx%d image\n", WIDTH, HEIGHT);
+    exit(1);
   }
-  if(argc == 3)
+  if(num_args == 2)
     {
       mode = MODE_JPEG;
-      filename = argv[2];
+      filename = args[1];
     }
-  else if(argc == 2)
+  else
     mode = MODE_DISPLAY;
+  //worker processes split the cores between them
+  if(num_threads <= 0)
+    num_threads = std::max(1u, std::thread::hardware_concurrency() / std::max(num_workers, 1));
+  //with a budget the clock ends the render, -spp only caps it
+  if(samples_per_pixel <= 0)
+    samples_per_pixel = time_budget > 0 ? BUDGET_MAX_SAMPLES : render_mode == RENDER_PATH ? PATH_SAMPLES : 1;
+  memset(pixel_active, 1, sizeof(pixel_active));
+  build_gamma_table();
 
-  glutInit(&argc,argv);
-  loadScene(argv[1]);
+  int input_type = pic_filename_type(args[0]);
+  if(input_type == PIC_PFM_FILE || input_type == PIC_HDR_FILE)
+  {
+    //nothing to render, just tone map the saved radiance
+    if(!load_hdr(args[0]))
+      exit(1);
+    passes_done = samples_per_pixel;
+    watch_scene = false;
+  }
+  else
+  {
+    //a cached scene skips the parsing and the bvh build
+    scene_file = args[0];
+    uint64_t scene_hash = cache_file || watch_scene || checkpoint_file ? hash_file(scene_file) : 0;
+    scene_file_hash = scene_hash;
+    if(!cache_file || !read_scene_cache(scene_hash))
+    {
+      int loaded;
+      if(serial_parse)
+        loaded = loadScene(scene_file);
+      else
+        loaded = load_scene_parallel(scene_file);
+      if(!loaded)
+        exit(0);
+      build_bvh();
+      if(cache_file)
+        write_scene_cache(scene_hash);
+    }
+    build_wide_bvh();
+    build_instances();
+    report_arena();
+    if(resume && checkpoint_file)
+      read_checkpoint();
+    if(watch_scene)
+      watch_files(scene_hash);
+  }
+
+  //group the lights so shading points can sample them by importance
+  for(int i = 0; i < num_lights; i++)
+    light_tree_order[i] = i;
+  if(num_lights > 0)
+    build_light_tree(0, num_lights);
+  find_scene_bounds();
+
+  //fork before glut is touched, workers never open a window. ones forked again
+  //after a reload close what they inherit from it
+  if(num_workers > 0 && passes_done < samples_per_pixel)
+    start_workers();
+  else
+    num_workers = 0;
 
+  glutInit(&argc,argv);
   glutInitDisplayMode(GLUT_RGBA | GLUT_SINGLE);
   glutInitWindowPosition(0,0);
   glutInitWindowSize(WIDTH,HEIGHT);